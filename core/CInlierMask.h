@@ -0,0 +1,127 @@
+/* +---------------------------------------------------------------------------+
+   |                     Mobile Robot Programming Toolkit (MRPT)               |
+   |                          http://www.mrpt.org/                             |
+   |                                                                           |
+   | Copyright (c) 2005-2018, Individual contributors, see AUTHORS file        |
+   | See: http://www.mrpt.org/Authors - All rights reserved.                   |
+   | Released under BSD License. See details in http://www.mrpt.org/License    |
+   +---------------------------------------------------------------------------+ */
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <iterator>
+#include <vector>
+
+/**
+ * \brief Set of pixel indices of an organized cloud, stored as runs of consecutive indices.
+ *
+ * The inliers of a segmented region mostly cover whole stretches of image rows, so a run (start, length)
+ * replaces tens to hundreds of individual indices. The indices are iterated in increasing order, and
+ * the interface follows the subset of std::vector<int> used by the consumers of the inliers.
+ */
+
+class CInlierMask
+{
+  public:
+
+	/** A run of consecutive pixel indices. */
+	struct TRun
+	{
+		uint32_t start;
+		uint32_t length;
+	};
+
+	/** Forward iterator over the pixel indices of the mask. */
+	class const_iterator
+	{
+	  public:
+		typedef std::forward_iterator_tag iterator_category;
+		typedef int value_type;
+		typedef std::ptrdiff_t difference_type;
+		typedef const int* pointer;
+		typedef int reference;
+
+		const_iterator(std::vector<TRun>::const_iterator run, uint32_t offset) : m_run(run), m_offset(offset) {}
+
+		int operator*() const { return m_run->start + m_offset; }
+
+		const_iterator &operator++()
+		{
+			if(++m_offset == m_run->length)
+			{
+				++m_run;
+				m_offset = 0;
+			}
+			return *this;
+		}
+
+		const_iterator operator++(int)
+		{
+			const_iterator it = *this;
+			++(*this);
+			return it;
+		}
+
+		bool operator==(const const_iterator &other) const { return m_run == other.m_run && m_offset == other.m_offset; }
+		bool operator!=(const const_iterator &other) const { return !(*this == other); }
+
+	  private:
+		std::vector<TRun>::const_iterator m_run;
+		uint32_t m_offset;
+	};
+
+	CInlierMask() = default;
+
+	/** Builds the mask from a list of indices in any order, without duplicates. */
+	CInlierMask(std::vector<int> indices)
+	{
+		std::sort(indices.begin(), indices.end());
+		for(const int &index : indices)
+			push_back(index);
+		m_runs.shrink_to_fit();
+	}
+
+	/** Appends an index, which must be greater than all the indices already in the mask. */
+	void push_back(const int &index)
+	{
+		if(!m_runs.empty() && m_runs.back().start + m_runs.back().length == static_cast<uint32_t>(index))
+			m_runs.back().length++;
+		else
+			m_runs.push_back(TRun{static_cast<uint32_t>(index), 1});
+		m_size++;
+	}
+
+	void clear()
+	{
+		m_runs.clear();
+		m_size = 0;
+	}
+
+	/** Releases the memory left over from building the mask. */
+	void shrink_to_fit() { m_runs.shrink_to_fit(); }
+
+	size_t size() const { return m_size; }
+
+	bool empty() const { return m_size == 0; }
+
+	const_iterator begin() const { return const_iterator(m_runs.begin(), 0); }
+
+	const_iterator end() const { return const_iterator(m_runs.end(), 0); }
+
+	/** Returns whether the mask contains an index, in logarithmic time. */
+	bool contains(const int &index) const
+	{
+		auto run = std::upper_bound(m_runs.begin(), m_runs.end(), static_cast<uint32_t>(index),
+		                            [](const uint32_t &value, const TRun &run) { return value < run.start; });
+		return run != m_runs.begin() && static_cast<uint32_t>(index) < (run - 1)->start + (run - 1)->length;
+	}
+
+	const std::vector<TRun> &runs() const { return m_runs; }
+
+  private:
+
+	std::vector<TRun> m_runs;
+
+	size_t m_size = 0;
+};
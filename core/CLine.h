@@ -11,35 +11,40 @@
 
 #include <array>
 #include <Eigen/Core>
+#include "Scalar.h"
 
-typedef float Scalar;
+/**
+ * Represents the extracted line along with its 2D and 3D geometrical characteristics.
+ * \tparam T the precision of the line parameters.
+ */
 
-/** Represents the extracted line along with its 2D and 3D geometrical characteristics. */
-
-class CLine
+template<typename T>
+class CLineT
 {
 public:
 
-	Scalar rho;
-	Scalar theta;
+	T rho;
+	T theta;
 
-	Scalar m;
-	Scalar c;
+	T m;
+	T c;
 
 	std::array<Eigen::Vector2i,2> end_points;
-	std::array<Eigen::Vector3f,2> end_points3D;
+	std::array<Eigen::Matrix<T,3,1>,2> end_points3D;
 	Eigen::Vector2i mean_point;
 
 	/** The 2D direction vector. [lx ly 0] */
 	Eigen::Vector3i l;
 
 	/** Equation of the 3D ray passing through the mean_point from the camera centre. */
-	Eigen::Vector3f ray;
+	Eigen::Matrix<T,3,1> ray;
 	/** Equation of the 3D normal of the projective plane. */
-	Eigen::Vector3f normal;
+	Eigen::Matrix<T,3,1> normal;
 
 	/** 3D coordinates of the mean_point. */
-	Eigen::Vector3f p;
+	Eigen::Matrix<T,3,1> p;
 	/** 3D direction vector of the line. */
-	Eigen::Vector3f v;
+	Eigen::Matrix<T,3,1> v;
 };
+
+typedef CLineT<Scalar> CLine;
@@ -0,0 +1,69 @@
+/* +------------------------------------------------------------------------+
+   |                     Mobile Robot Programming Toolkit (MRPT)            |
+   |                          http://www.mrpt.org/                          |
+   |                                                                        |
+   | Copyright (c) 2005-2018, Individual contributors, see AUTHORS file     |
+   | See: http://www.mrpt.org/Authors - All rights reserved.                |
+   | Released under BSD License. See details in http://www.mrpt.org/License |
+   +------------------------------------------------------------------------+ */
+
+#include "CNormalSphereIndex.h"
+#include <algorithm>
+#include <cmath>
+
+void CNormalSphereIndex::sphericalAngles(const Eigen::Matrix<Scalar,3,1> &normal, Scalar &polar, Scalar &azimuth)
+{
+	polar = std::acos(std::max<Scalar>(-1, std::min<Scalar>(1, normal(2))));
+	azimuth = std::atan2(normal(1), normal(0)) + static_cast<Scalar>(M_PI);
+}
+
+void CNormalSphereIndex::build(const Eigen::Matrix<Scalar,3,Eigen::Dynamic> &normals, const Scalar &cone_angle)
+{
+	// A small margin keeps the cells conservative with respect to the rounding of the angles
+	m_cone_angle = cone_angle + 1e-4f;
+	m_rows = std::max(1, std::min(90, static_cast<int>(M_PI / m_cone_angle)));
+	m_cols = 2 * m_rows;
+	mv_cells.assign(m_rows * m_cols, std::vector<int>());
+
+	for(int k = 0; k < normals.cols(); k++)
+	{
+		Scalar polar, azimuth;
+		sphericalAngles(normals.col(k), polar, azimuth);
+		int row = std::min(m_rows - 1, static_cast<int>(polar * m_rows / M_PI));
+		int col = std::min(m_cols - 1, static_cast<int>(azimuth * m_cols / (2 * M_PI)));
+		mv_cells[row * m_cols + col].push_back(k);
+	}
+}
+
+void CNormalSphereIndex::query(const Eigen::Matrix<Scalar,3,1> &normal, std::vector<int> &candidates) const
+{
+	candidates.clear();
+	if(m_rows == 0)
+		return;
+
+	Scalar polar, azimuth;
+	sphericalAngles(normal, polar, azimuth);
+
+	const Scalar polar_min = polar - m_cone_angle, polar_max = polar + m_cone_angle;
+	int row_begin = std::max(0, static_cast<int>(std::floor(polar_min * m_rows / M_PI)));
+	int row_end = std::min(m_rows - 1, static_cast<int>(std::floor(polar_max * m_rows / M_PI)));
+
+	// The cone covers every azimuth when it contains a pole
+	int col_begin = 0, col_count = m_cols;
+	if(polar_min > 0 && polar_max < M_PI && std::sin(m_cone_angle) < std::sin(polar))
+	{
+		Scalar half_width = std::asin(std::sin(m_cone_angle) / std::sin(polar));
+		col_begin = static_cast<int>(std::floor((azimuth - half_width) * m_cols / (2 * M_PI)));
+		col_count = std::min(m_cols, static_cast<int>(std::floor((azimuth + half_width) * m_cols / (2 * M_PI))) - col_begin + 1);
+	}
+
+	for(int row = row_begin; row <= row_end; row++)
+		for(int k = 0; k < col_count; k++)
+		{
+			int col = ((col_begin + k) % m_cols + m_cols) % m_cols;
+			const std::vector<int> &cell = mv_cells[row * m_cols + col];
+			candidates.insert(candidates.end(), cell.begin(), cell.end());
+		}
+
+	std::sort(candidates.begin(), candidates.end());
+}
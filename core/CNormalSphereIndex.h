@@ -0,0 +1,55 @@
+/* +------------------------------------------------------------------------+
+   |                     Mobile Robot Programming Toolkit (MRPT)            |
+   |                          http://www.mrpt.org/                          |
+   |                                                                        |
+   | Copyright (c) 2005-2018, Individual contributors, see AUTHORS file     |
+   | See: http://www.mrpt.org/Authors - All rights reserved.                |
+   | Released under BSD License. See details in http://www.mrpt.org/License |
+   +------------------------------------------------------------------------+ */
+#pragma once
+
+#include <CPlane.h>
+#include <Eigen/Core>
+#include <vector>
+
+/**
+ * \brief Latitude-longitude grid over the unit sphere that bins a set of normals by direction.
+ *
+ * The grid is built for a fixed cone angle, with cells at least as tall as the cone, so that a query only visits the
+ * two or three rows of cells the cone spans and, within them, the columns covered by its azimuth extent
+ * asin(sin(cone_angle) / sin(polar_angle)). The query returns a superset of the normals within the cone,
+ * the exact angle test is left to the caller.
+ */
+
+class CNormalSphereIndex
+{
+  public:
+
+	/**
+	 * \brief Builds the index.
+	 * \param normals the unit normals to index, as columns.
+	 * \param cone_angle the half angle of the cones that will be queried, in radians.
+	 */
+	void build(const Eigen::Matrix<Scalar,3,Eigen::Dynamic> &normals, const Scalar &cone_angle);
+
+	/**
+	 * \brief Finds the indexed normals that may lie within the cone around a normal.
+	 * \param normal the axis of the cone.
+	 * \param candidates the column indices of the candidate normals, in increasing order.
+	 */
+	void query(const Eigen::Matrix<Scalar,3,1> &normal, std::vector<int> &candidates) const;
+
+  private:
+
+	/** Calculates the polar and azimuth angles of a normal. */
+	static void sphericalAngles(const Eigen::Matrix<Scalar,3,1> &normal, Scalar &polar, Scalar &azimuth);
+
+	int m_rows = 0;
+
+	int m_cols = 0;
+
+	Scalar m_cone_angle = 0;
+
+	/** The normal indices in each cell, stored row-major. */
+	std::vector<std::vector<int>> mv_cells;
+};
@@ -290,4 +290,6 @@ int CObservationTree::findSyncIndexFromSet(const int &set_id, const std::string
 			return utils::findItemIndexIn(m_sync_indices[sensor_index], item->child(i)->getPriorIndex());
 		}
 	}
+
+	return -1;
 }
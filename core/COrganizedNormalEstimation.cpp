@@ -0,0 +1,151 @@
+/* +------------------------------------------------------------------------+
+   |                     Mobile Robot Programming Toolkit (MRPT)            |
+   |                          http://www.mrpt.org/                          |
+   |                                                                        |
+   | Copyright (c) 2005-2018, Individual contributors, see AUTHORS file     |
+   | See: http://www.mrpt.org/Authors - All rights reserved.                |
+   | Released under BSD License. See details in http://www.mrpt.org/License |
+   +------------------------------------------------------------------------+ */
+
+#include "COrganizedNormalEstimation.h"
+#include <cmath>
+#include <limits>
+
+void COrganizedNormalEstimation::setDepthDependentSmoothing(const bool &depth_dependent_smoothing)
+{
+	m_depth_dependent_smoothing = depth_dependent_smoothing;
+}
+
+void COrganizedNormalEstimation::setMaxDepthChangeFactor(const float &max_depth_change_factor)
+{
+	m_max_depth_change_factor = max_depth_change_factor;
+}
+
+void COrganizedNormalEstimation::setNormalSmoothingSize(const float &normal_smoothing_size)
+{
+	m_normal_smoothing_size = normal_smoothing_size;
+}
+
+void COrganizedNormalEstimation::setInputCloud(const pcl::PointCloud<pcl::PointXYZRGBA>::ConstPtr &cloud)
+{
+	m_cloud = cloud;
+}
+
+void COrganizedNormalEstimation::integrate(const ImageArray &image, IntegralArray &integral)
+{
+	const int rows = image.rows();
+	integral.setZero(rows + 1, image.cols() + 1);
+
+	// Cumulative sum along the columns, vectorized over the (contiguous) rows of each column
+	for(int c = 0; c < image.cols(); c++)
+		integral.col(c + 1).tail(rows) = integral.col(c).tail(rows) + image.col(c).cast<double>();
+
+	// Cumulative sum along the rows
+	for(int r = 0; r < rows; r++)
+		integral.row(r + 1) += integral.row(r);
+}
+
+void COrganizedNormalEstimation::compute(pcl::PointCloud<pcl::Normal> &normals) const
+{
+	const int height = m_cloud->height;
+	const int width = m_cloud->width;
+	const float nan = std::numeric_limits<float>::quiet_NaN();
+
+	pcl::Normal invalid_normal;
+	invalid_normal.normal_x = invalid_normal.normal_y = invalid_normal.normal_z = invalid_normal.curvature = nan;
+	normals.points.assign(m_cloud->points.size(), invalid_normal);
+	normals.width = width;
+	normals.height = height;
+	normals.is_dense = false;
+
+	if(height < 3 || width < 3)
+		return;
+
+	// Split the points into structure-of-arrays images. Invalid points are zeroed and marked as discontinuities.
+	ImageArray x(height, width), y(height, width), z(height, width), edge(height, width);
+	for(int r = 0; r < height; r++)
+		for(int c = 0; c < width; c++)
+		{
+			const pcl::PointXYZRGBA &point = m_cloud->points[r * width + c];
+			bool valid = std::isfinite(point.z);
+			x(r,c) = valid ? point.x : 0.f;
+			y(r,c) = valid ? point.y : 0.f;
+			z(r,c) = valid ? point.z : 0.f;
+			edge(r,c) = valid ? 0.f : 1.f;
+		}
+
+	// A pixel is a discontinuity when the depth jump to its right or lower neighbour exceeds the same
+	// depth dependent threshold used by pcl. Any window containing such a pixel straddles the jump.
+	ImageArray max_change = m_max_depth_change_factor * (z.abs() + 1.f) * 2.f;
+	edge.leftCols(width - 1) = edge.leftCols(width - 1).max(
+	            ((z.rightCols(width - 1) - z.leftCols(width - 1)).abs() > max_change.leftCols(width - 1)).cast<float>());
+	edge.topRows(height - 1) = edge.topRows(height - 1).max(
+	            ((z.bottomRows(height - 1) - z.topRows(height - 1)).abs() > max_change.topRows(height - 1)).cast<float>());
+
+	// The desired half size of the smoothing window at each pixel
+	ImageArray half_size = ImageArray::Constant(height, width, 0.5f * m_normal_smoothing_size);
+	if(m_depth_dependent_smoothing)
+		half_size += 0.05f * z;
+	half_size = half_size.max(1.f);
+
+	IntegralArray ix, iy, iz, iedge;
+	integrate(x, ix);
+	integrate(y, iy);
+	integrate(z, iz);
+	integrate(edge, iedge);
+
+	Eigen::Array<bool,Eigen::Dynamic,Eigen::Dynamic> assigned = Eigen::Array<bool,Eigen::Dynamic,Eigen::Dynamic>::Constant(height, width, false);
+
+	// Try the largest window first and halve it for the pixels where it is not acceptable
+	for(int k = std::max(1, static_cast<int>(half_size.maxCoeff())); k >= 1; k /= 2)
+	{
+		const int h = height - 2 * k;
+		const int w = width - 2 * k;
+		if(h <= 0 || w <= 0)
+			continue;
+
+		// Sum over rows [r+r0, r+r1) and columns [c+c0, c+c1) for all the pixels at least k away from the border
+		auto box = [&](const IntegralArray &integral, int r0, int r1, int c0, int c1) -> Eigen::ArrayXXf
+		{
+			return (integral.block(k + r1, k + c1, h, w) - integral.block(k + r0, k + c1, h, w)
+			        - integral.block(k + r1, k + c0, h, w) + integral.block(k + r0, k + c0, h, w)).cast<float>();
+		};
+
+		const float inv_count = 1.f / (k * (2 * k + 1));
+
+		// Horizontal and vertical tangents: differences between the mean points of the opposite half windows
+		Eigen::ArrayXXf hx = (box(ix, -k, k + 1, 1, k + 1) - box(ix, -k, k + 1, -k, 0)) * inv_count;
+		Eigen::ArrayXXf hy = (box(iy, -k, k + 1, 1, k + 1) - box(iy, -k, k + 1, -k, 0)) * inv_count;
+		Eigen::ArrayXXf hz = (box(iz, -k, k + 1, 1, k + 1) - box(iz, -k, k + 1, -k, 0)) * inv_count;
+		Eigen::ArrayXXf vx = (box(ix, 1, k + 1, -k, k + 1) - box(ix, -k, 0, -k, k + 1)) * inv_count;
+		Eigen::ArrayXXf vy = (box(iy, 1, k + 1, -k, k + 1) - box(iy, -k, 0, -k, k + 1)) * inv_count;
+		Eigen::ArrayXXf vz = (box(iz, 1, k + 1, -k, k + 1) - box(iz, -k, 0, -k, k + 1)) * inv_count;
+
+		Eigen::ArrayXXf nx = hy * vz - hz * vy;
+		Eigen::ArrayXXf ny = hz * vx - hx * vz;
+		Eigen::ArrayXXf nz = hx * vy - hy * vx;
+
+		// Orient the normals towards the sensor and normalize them
+		Eigen::ArrayXXf towards_point = nx * x.block(k, k, h, w) + ny * y.block(k, k, h, w) + nz * z.block(k, k, h, w);
+		Eigen::ArrayXXf norm = (nx.square() + ny.square() + nz.square()).sqrt();
+		Eigen::ArrayXXf scale = (towards_point > 0.f).select(-norm.inverse(), norm.inverse());
+
+		Eigen::Array<bool,Eigen::Dynamic,Eigen::Dynamic> accept = (box(iedge, -k, k + 1, -k, k + 1) == 0.f)
+		        && (half_size.block(k, k, h, w) >= static_cast<float>(k)) && (norm > 0.f) && !assigned.block(k, k, h, w);
+
+		for(int c = 0; c < w; c++)
+			for(int r = 0; r < h; r++)
+			{
+				if(!accept(r,c))
+					continue;
+
+				pcl::Normal &normal = normals.points[(r + k) * width + c + k];
+				normal.normal_x = nx(r,c) * scale(r,c);
+				normal.normal_y = ny(r,c) * scale(r,c);
+				normal.normal_z = nz(r,c) * scale(r,c);
+				normal.curvature = 0.f;
+			}
+
+		assigned.block(k, k, h, w) = assigned.block(k, k, h, w) || accept;
+	}
+}
@@ -0,0 +1,63 @@
+/* +------------------------------------------------------------------------+
+   |                     Mobile Robot Programming Toolkit (MRPT)            |
+   |                          http://www.mrpt.org/                          |
+   |                                                                        |
+   | Copyright (c) 2005-2018, Individual contributors, see AUTHORS file     |
+   | See: http://www.mrpt.org/Authors - All rights reserved.                |
+   | Released under BSD License. See details in http://www.mrpt.org/License |
+   +------------------------------------------------------------------------+ */
+#pragma once
+
+#include <pcl/point_cloud.h>
+#include <pcl/point_types.h>
+#include <Eigen/Core>
+
+/**
+ * \brief Estimates the surface normals of an organized cloud from cross products of neighbour differences.
+ *
+ * The points are split into x, y, z planes and integrated once, after which the mean point of the boxes
+ * on each side of a pixel is available in constant time. The horizontal and vertical tangents are the differences
+ * of these means and the normal is their cross product. All the per-pixel arithmetic is expressed as whole-image
+ * Eigen array operations, so it is vectorized by the compiler.
+ *
+ * The smoothing window follows pcl::IntegralImageNormalEstimation: normal_smoothing_size is its full width, it grows
+ * with depth when depth dependent smoothing is set, and it is shrunk (down to a 3x3 window) whenever it would cross a
+ * depth discontinuity larger than max_depth_change_factor. The output is a drop-in replacement for the
+ * pcl::Normal cloud consumed by pcl::OrganizedMultiPlaneSegmentation.
+ */
+
+class COrganizedNormalEstimation
+{
+  public:
+
+	void setDepthDependentSmoothing(const bool &depth_dependent_smoothing);
+
+	void setMaxDepthChangeFactor(const float &max_depth_change_factor);
+
+	void setNormalSmoothingSize(const float &normal_smoothing_size);
+
+	/** Sets the input cloud, which must be organized. */
+	void setInputCloud(const pcl::PointCloud<pcl::PointXYZRGBA>::ConstPtr &cloud);
+
+	/**
+	 * \brief Computes the normals of the input cloud, oriented towards the sensor.
+	 * \param normals the output normals, organized like the input. Pixels without a valid normal are set to NaN.
+	 */
+	void compute(pcl::PointCloud<pcl::Normal> &normals) const;
+
+  private:
+
+	typedef Eigen::Array<float,Eigen::Dynamic,Eigen::Dynamic> ImageArray;
+	typedef Eigen::Array<double,Eigen::Dynamic,Eigen::Dynamic> IntegralArray;
+
+	/** Calculates the summed area table of an image, with an extra leading row and column of zeros. */
+	static void integrate(const ImageArray &image, IntegralArray &integral);
+
+	pcl::PointCloud<pcl::PointXYZRGBA>::ConstPtr m_cloud;
+
+	bool m_depth_dependent_smoothing = true;
+
+	float m_max_depth_change_factor = 0.02f;
+
+	float m_normal_smoothing_size = 10.0f;
+};
@@ -9,27 +9,356 @@
 #pragma once
 
 #include <mrpt/math/CMatrix.h>
+#include <Eigen/Dense>
+#include <algorithm>
+#include "CInlierMask.h"
+#include "Scalar.h"
+#include "Utils.h"
 #include <pcl/point_cloud.h>
 #include <pcl/point_types.h>
 
-typedef float Scalar;
+/**
+ * Sufficient statistics of the inlier points of a plane, accumulated in double precision.
+ * The plane parameters and their uncertainty can be recovered from them without revisiting the points,
+ * and the statistics of two regions of the same plane are merged by simply adding them.
+ */
+struct TPlaneMoments
+{
+	/** Number of accumulated points. */
+	size_t n = 0;
+
+	/** Sum of the points. */
+	Eigen::Vector3d sum = Eigen::Vector3d::Zero();
+
+	/** Sum of the outer products of the points, upper triangle stored as [xx xy xz yy yz zz]. */
+	Eigen::Matrix<double,6,1> sum_sq = Eigen::Matrix<double,6,1>::Zero();
+
+	/** Sum of the colours of the points, as [r g b]. */
+	Eigen::Vector3d color_sum = Eigen::Vector3d::Zero();
+
+	void addPoint(const Eigen::Vector3f &point)
+	{
+		const Eigen::Vector3d p = point.cast<double>();
+		n++;
+		sum += p;
+		sum_sq += (Eigen::Matrix<double,6,1>() << p(0)*p(0), p(0)*p(1), p(0)*p(2), p(1)*p(1), p(1)*p(2), p(2)*p(2)).finished();
+	}
+
+	/** Accumulates the position and the colour of a point. */
+	void addPoint(const pcl::PointXYZRGBA &point)
+	{
+		addPoint(point.getVector3fMap());
+		color_sum += Eigen::Vector3d(point.r, point.g, point.b);
+	}
+
+	TPlaneMoments &operator+=(const TPlaneMoments &other)
+	{
+		n += other.n;
+		sum += other.sum;
+		sum_sq += other.sum_sq;
+		color_sum += other.color_sum;
+		return *this;
+	}
 
-/** Store the plane extracted from a depth image (or point cloud) defined by some geometric characteristics. */
-class CPlane
+	/** Returns the centroid of the accumulated points. */
+	Eigen::Vector3d mean() const
+	{
+		return sum / n;
+	}
+
+	/** Returns the covariance of the accumulated points about their centroid. */
+	Eigen::Matrix3d scatter() const
+	{
+		Eigen::Matrix3d second;
+		second << sum_sq(0), sum_sq(1), sum_sq(2),
+		          sum_sq(1), sum_sq(3), sum_sq(4),
+		          sum_sq(2), sum_sq(4), sum_sq(5);
+		const Eigen::Vector3d c = mean();
+		return second / n - c * c.transpose();
+	}
+
+	/** Returns the surface variation (curvature) of the accumulated points: the smallest eigenvalue of the scatter over their sum. */
+	double curvature() const
+	{
+		Eigen::Vector3d lambda = Eigen::SelfAdjointEigenSolver<Eigen::Matrix3d>(scatter(), Eigen::EigenvaluesOnly).eigenvalues();
+		return lambda(0) / lambda.sum();
+	}
+};
+
+/**
+ * Cheap descriptor of a segmented plane, used to tell apart planes with similar parameters.
+ * The extents are those of a uniformly covered rectangle with the same second moments as the inliers.
+ */
+struct TPlaneDescriptor
+{
+	/** Area of the plane in squared meters. */
+	Scalar area = 0;
+
+	/** Lengths of the plane along its major and minor axes. */
+	Scalar major_extent = 0, minor_extent = 0;
+
+	/** Ratio of the minor to the major extent, in (0, 1]. */
+	Scalar elongation = 0;
+
+	/** Mean colour of the inliers, as [r g b] in [0, 255]. */
+	Eigen::Matrix<Scalar,3,1> color = Eigen::Matrix<Scalar,3,1>::Zero();
+
+	/** Number of inliers. */
+	size_t inliers_count = 0;
+
+	/** Calculates the descriptor from the moments of the inliers. */
+	void calcFromMoments(const TPlaneMoments &moments)
+	{
+		inliers_count = moments.n;
+		if(moments.n == 0)
+			return;
+
+		const Eigen::Vector3d lambda = Eigen::SelfAdjointEigenSolver<Eigen::Matrix3d>(moments.scatter(), Eigen::EigenvaluesOnly).eigenvalues();
+		major_extent = std::sqrt(12 * std::max(0.0, lambda(2)));
+		minor_extent = std::sqrt(12 * std::max(0.0, lambda(1)));
+		area = major_extent * minor_extent;
+		elongation = major_extent > 0 ? minor_extent / major_extent : 0;
+		color = (moments.color_sum / moments.n).cast<Scalar>();
+	}
+
+	/**
+	 * Checks whether two descriptors are similar: the relative difference of their areas, the difference of
+	 * their elongations and the largest difference of their mean colour channels (over 255) are all below tolerance.
+	 * The inlier count depends on the distance and resolution of each sensor, so it is not compared.
+	 */
+	bool isSimilar(const TPlaneDescriptor &other, const Scalar &tolerance) const
+	{
+		return std::abs(area - other.area) <= tolerance * std::max(area, other.area)
+		        && std::abs(elongation - other.elongation) <= tolerance
+		        && (color - other.color).cwiseAbs().maxCoeff() <= tolerance * 255;
+	}
+};
+
+/**
+ * Store the plane extracted from a depth image (or point cloud) defined by some geometric characteristics.
+ * \tparam T the precision of the plane parameters.
+ */
+template<typename T>
+class CPlaneT
 {
   public:
 	EIGEN_MAKE_ALIGNED_OPERATOR_NEW
 
-    Eigen::Matrix<Scalar,3,1> v3center;
-    Eigen::Matrix<Scalar,3,1> v3normal;
-    Scalar d;
+    Eigen::Matrix<T,3,1> v3center;
+    Eigen::Matrix<T,3,1> v3normal;
+    T d;
 };
 
+typedef CPlaneT<Scalar> CPlane;
+
 /** Store the plane's geometric characteristics and its convex hull. */
 class CPlaneCHull : public CPlane
 {
   public:
-    pcl::PointCloud<pcl::PointXYZRGBA>::Ptr ConvexHullPtr;
-    std::vector<size_t> v_hull_indices;
-    std::vector<int> v_inliers;
+	/**
+	 * Points of the region's contour and their pixel indices in the organized cloud.
+	 * They are kept until the convex hull is first requested, so the hulls of the planes that are never displayed or matched
+	 * by their overlap are not calculated. The contour of merged regions only holds the hull vertices of both (see mergeContour()).
+	 */
+	pcl::PointCloud<pcl::PointXYZRGBA>::Ptr contour_cloud;
+	std::vector<int> v_contour_indices;
+
+	/** Pixel indices of the inliers in the organized cloud, stored as runs. */
+	CInlierMask v_inliers;
+
+	/** Sufficient statistics of the inliers, filled in by the segmentation. */
+	TPlaneMoments moments;
+
+	/** Covariance of the plane parameters [nx ny nz d], calculated from the moments. */
+	Eigen::Matrix<Scalar,4,4> m4cov = Eigen::Matrix<Scalar,4,4>::Zero();
+
+	/** Descriptor of the plane's shape and appearance, calculated from the moments. */
+	TPlaneDescriptor descriptor;
+
+	/**
+	 * Sets the plane parameters to the least-squares fit of the inlier moments, with the normal pointing towards the sensor,
+	 * and calculates their covariance and the plane's descriptor.
+	 */
+	void calcPlaneFromMoments()
+	{
+		Eigen::SelfAdjointEigenSolver<Eigen::Matrix3d> eigen_solver(moments.scatter());
+		Eigen::Vector3d normal = eigen_solver.eigenvectors().col(0);
+		Eigen::Vector3d center = moments.mean();
+		double dist = -normal.dot(center);
+
+		if(dist < 0)
+		{
+			normal = -normal;
+			dist = -dist;
+		}
+
+		v3center = center.cast<Scalar>();
+		v3normal = normal.cast<Scalar>();
+		d = dist;
+		calcCovariance();
+		descriptor.calcFromMoments(moments);
+	}
+
+	/**
+	 * Calculates the covariance of the plane parameters from the inlier moments.
+	 * The residual variance of the fit is the smallest eigenvalue of the scatter matrix, and the normal
+	 * is perturbed along the two in-plane eigenvectors in inverse proportion to the spread of the points along them.
+	 */
+	void calcCovariance()
+	{
+		m4cov.setZero();
+		if(moments.n < 4)
+			return;
+
+		Eigen::SelfAdjointEigenSolver<Eigen::Matrix3d> eigen_solver(moments.scatter());
+		const Eigen::Vector3d lambda = eigen_solver.eigenvalues();
+		const Eigen::Matrix3d v = eigen_solver.eigenvectors();
+		const Eigen::Vector3d c = moments.mean();
+
+		Eigen::Matrix3d cov_n = Eigen::Matrix3d::Zero();
+		for(int k = 1; k < 3; k++)
+		{
+			double gap = lambda(k) - lambda(0);
+			if(gap > 0)
+				cov_n += (lambda(0) * lambda(k)) / ((moments.n - 1) * gap * gap) * v.col(k) * v.col(k).transpose();
+		}
+
+		Eigen::Matrix4d cov;
+		cov.block<3,3>(0,0) = cov_n;
+		cov.block<3,1>(0,3) = -cov_n * c;
+		cov.block<1,3>(3,0) = cov.block<3,1>(0,3).transpose();
+		cov(3,3) = lambda(0) / moments.n + c.dot(cov_n * c);
+		m4cov = cov.cast<Scalar>();
+	}
+
+	/** Returns the vertices of the convex hull of the contour, calculating it on the first call. */
+	const pcl::PointCloud<pcl::PointXYZRGBA>::Ptr &getConvexHull() const
+	{
+		calcConvexHull();
+		return m_hull_cloud;
+	}
+
+	/** Returns the pixel indices of the convex hull vertices, calculating the hull on the first call. */
+	const std::vector<size_t> &getHullIndices() const
+	{
+		calcConvexHull();
+		return mv_hull_indices;
+	}
+
+	/**
+	 * Calculates the convex hull of the contour (counter-clockwise around the normal) if it is not cached yet.
+	 * The contour is expressed in an orthonormal basis of the plane and the hull is found with the monotone chain algorithm.
+	 * As the cache is not synchronized, it must be filled before the plane is shared between threads.
+	 */
+	void calcConvexHull() const
+	{
+		if(m_hull_valid)
+			return;
+
+		m_hull_cloud.reset(new pcl::PointCloud<pcl::PointXYZRGBA>);
+		mv_hull_indices.clear();
+		m_hull_valid = true;
+
+		if(!contour_cloud)
+			return;
+
+		const size_t n = contour_cloud->points.size();
+		const Eigen::Matrix<Scalar,3,1> u = v3normal.unitOrthogonal();
+		const Eigen::Matrix<Scalar,3,1> v = v3normal.cross(u);
+
+		std::vector<Eigen::Matrix<Scalar,2,1>, Eigen::aligned_allocator<Eigen::Matrix<Scalar,2,1>>> points(n);
+		for(size_t i = 0; i < n; i++)
+		{
+			Eigen::Matrix<Scalar,3,1> p = contour_cloud->points[i].getVector3fMap() - v3center;
+			points[i] << u.dot(p), v.dot(p);
+		}
+
+		std::vector<size_t> order(n);
+		for(size_t i = 0; i < n; i++)
+			order[i] = i;
+		std::sort(order.begin(), order.end(), [&](const size_t &a, const size_t &b)
+		{ return points[a](0) < points[b](0) || (points[a](0) == points[b](0) && points[a](1) < points[b](1)); });
+
+		auto cross = [&](const size_t &o, const size_t &a, const size_t &b)
+		{ return (points[a] - points[o]).x() * (points[b] - points[o]).y() - (points[a] - points[o]).y() * (points[b] - points[o]).x(); };
+
+		// Lower hull from left to right, then upper hull from right to left
+		std::vector<size_t> hull = order;
+		if(n >= 3)
+		{
+			size_t k = 0;
+			for(size_t i = 0; i < n; i++)
+			{
+				while(k >= 2 && cross(hull[k-2], hull[k-1], order[i]) <= 0)
+					k--;
+				hull[k++] = order[i];
+			}
+			hull.resize(2 * n);
+			for(size_t i = n - 1, lower = k + 1; i-- > 0;)
+			{
+				while(k >= lower && cross(hull[k-2], hull[k-1], order[i]) <= 0)
+					k--;
+				hull[k++] = order[i];
+			}
+			hull.resize(k - 1);
+		}
+
+		for(const size_t &i : hull)
+		{
+			m_hull_cloud->points.push_back(contour_cloud->points[i]);
+			mv_hull_indices.push_back(v_contour_indices[i]);
+		}
+		m_hull_cloud->width = m_hull_cloud->points.size();
+		m_hull_cloud->height = 1;
+	}
+
+	/**
+	 * Checks whether another plane is part of the same surface: their normals are parallel within cos_angle, the center
+	 * of each lies within dist_centre of the other and their convex hulls, projected onto this plane, are nearer than proximity.
+	 * The hulls only have a few vertices, so the test does not depend on the length of the contours.
+	 */
+	bool isSamePlane(const CPlaneCHull &plane, const Scalar &cos_angle, const Scalar &dist_centre, const Scalar &proximity) const
+	{
+		if(v3normal.dot(plane.v3normal) < cos_angle)
+			return false;
+
+		if(std::abs(v3normal.dot(plane.v3center) + d) > dist_centre || std::abs(plane.v3normal.dot(v3center) + plane.d) > dist_centre)
+			return false;
+
+		const pcl::PointCloud<pcl::PointXYZRGBA> &hull = *getConvexHull(), &other_hull = *plane.getConvexHull();
+		if(hull.points.empty() || other_hull.points.empty())
+			return false;
+
+		Eigen::Matrix<Scalar,3,Eigen::Dynamic> vertices(3, hull.points.size()), other_vertices(3, other_hull.points.size());
+		for(size_t i = 0; i < hull.points.size(); i++)
+			vertices.col(i) = hull.points[i].getVector3fMap();
+		for(size_t i = 0; i < other_hull.points.size(); i++)
+			other_vertices.col(i) = other_hull.points[i].getVector3fMap();
+
+		return utils::convexPolygonsOverlap<Scalar>(vertices, other_vertices, v3normal, proximity);
+	}
+
+	/**
+	 * Merges the contour of another region of the same plane into this one. The convex hull of the union of the contours
+	 * is that of the union of their hulls, so only the hull vertices of both regions are kept as the new contour.
+	 */
+	void mergeContour(const CPlaneCHull &plane)
+	{
+		calcConvexHull();
+		plane.calcConvexHull();
+
+		pcl::PointCloud<pcl::PointXYZRGBA>::Ptr merged_cloud(new pcl::PointCloud<pcl::PointXYZRGBA>);
+		merged_cloud->points = m_hull_cloud->points;
+		merged_cloud->points.insert(merged_cloud->points.end(), plane.m_hull_cloud->points.begin(), plane.m_hull_cloud->points.end());
+		contour_cloud = merged_cloud;
+		v_contour_indices.assign(mv_hull_indices.begin(), mv_hull_indices.end());
+		v_contour_indices.insert(v_contour_indices.end(), plane.mv_hull_indices.begin(), plane.mv_hull_indices.end());
+		m_hull_valid = false;
+	}
+
+  private:
+
+	mutable bool m_hull_valid = false;
+	mutable pcl::PointCloud<pcl::PointXYZRGBA>::Ptr m_hull_cloud;
+	mutable std::vector<size_t> mv_hull_indices;
 };
@@ -0,0 +1,16 @@
+/* +---------------------------------------------------------------------------+
+   |                     Mobile Robot Programming Toolkit (MRPT)               |
+   |                          http://www.mrpt.org/                             |
+   |                                                                           |
+   | Copyright (c) 2005-2018, Individual contributors, see AUTHORS file        |
+   | See: http://www.mrpt.org/Authors - All rights reserved.                   |
+   | Released under BSD License. See details in http://www.mrpt.org/License    |
+   +---------------------------------------------------------------------------+ */
+
+#pragma once
+
+/**
+ * The precision in which the features (planes, lines and their correspondences) are stored.
+ * The solvers choose their own arithmetic precision at run time, see SolverPrecision.
+ */
+typedef float Scalar;
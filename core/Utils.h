@@ -6,6 +6,7 @@
 #include <mrpt/img/TCamera.h>
 #include <mrpt/poses/CPose3D.h>
 #include <Eigen/Core>
+#include <Eigen/Geometry>
 
 namespace utils
 {
@@ -90,4 +91,39 @@ namespace utils
 		point3D[0] = ((point[0] - params.cx())/params.fx()) * point3D[2];
 		point3D[1] = ((point[1] - params.cy())/params.fy()) * point3D[2];
 	}
+
+	/**
+	 * \brief Function template to check whether two planar convex polygons overlap once projected onto a common plane (separating axis test)
+	 * \param polygon1 the vertices of the first polygon, in order, as columns
+	 * \param polygon2 the vertices of the second polygon, in order, as columns
+	 * \param normal the normal of the plane they are projected onto
+	 * \param margin the gap allowed between the polygons for them to still overlap
+	 */
+	template <typename T>
+	bool convexPolygonsOverlap(const Eigen::Matrix<T,3,Eigen::Dynamic> &polygon1, const Eigen::Matrix<T,3,Eigen::Dynamic> &polygon2, const Eigen::Matrix<T,3,1> &normal, const T &margin)
+	{
+		Eigen::Matrix<T,2,3> basis;
+		basis.row(0) = normal.unitOrthogonal().transpose();
+		basis.row(1) = normal.cross(normal.unitOrthogonal()).normalized().transpose();
+
+		const Eigen::Matrix<T,2,Eigen::Dynamic> projected[2] = {basis * polygon1, basis * polygon2};
+
+		// The polygons are disjoint if and only if the normal of one of their edges separates them
+		for(const Eigen::Matrix<T,2,Eigen::Dynamic> &polygon : projected)
+			for(int k = 0; polygon.cols() > 1 && k < polygon.cols(); k++)
+			{
+				Eigen::Matrix<T,2,1> edge = polygon.col((k + 1) % polygon.cols()) - polygon.col(k);
+				if(edge.norm() == 0)
+					continue;
+
+				Eigen::Matrix<T,1,2> axis(-edge(1), edge(0));
+				axis.normalize();
+
+				Eigen::Matrix<T,1,Eigen::Dynamic> extent1 = axis * projected[0], extent2 = axis * projected[1];
+				if(extent1.maxCoeff() + margin < extent2.minCoeff() || extent2.maxCoeff() + margin < extent1.minCoeff())
+					return false;
+			}
+
+		return true;
+	}
 }
@@ -0,0 +1,369 @@
+/* +------------------------------------------------------------------------+
+   |                     Mobile Robot Programming Toolkit (MRPT)            |
+   |                          http://www.mrpt.org/                          |
+   |                                                                        |
+   | Copyright (c) 2005-2018, Individual contributors, see AUTHORS file     |
+   | See: http://www.mrpt.org/Authors - All rights reserved.                |
+   | Released under BSD License. See details in http://www.mrpt.org/License |
+   +------------------------------------------------------------------------+ */
+#pragma once
+
+#include <Eigen/Core>
+#include <Eigen/Cholesky>
+#include <Eigen/SparseCore>
+#include <Eigen/SparseCholesky>
+#include <algorithm>
+#include <array>
+#include <map>
+#include <vector>
+
+/** The contribution of the correspondences of a sensor pair to the normal equations, with B parameters per sensor (3 for a rotation or a translation, 6 for a pose). */
+
+template<typename T, int B = 3>
+struct TPairSystem
+{
+	Eigen::Matrix<T,B,B> h_ii, h_jj, h_ij;
+	Eigen::Matrix<T,B,1> g_i, g_j;
+	T error;
+
+	void setZero()
+	{
+		h_ii.setZero();
+		h_jj.setZero();
+		h_ij.setZero();
+		g_i.setZero();
+		g_j.setZero();
+		error = 0;
+	}
+
+	TPairSystem &operator+=(const TPairSystem &other)
+	{
+		h_ii += other.h_ii;
+		h_jj += other.h_jj;
+		h_ij += other.h_ij;
+		g_i += other.g_i;
+		g_j += other.g_j;
+		error += other.error;
+		return *this;
+	}
+};
+
+/**
+ * The correspondences of each sensor pair split in chunks of a fixed size, with the partial normal equations of each chunk.
+ * The chunks do not depend on the number of threads that accumulate them, and reduce() sums them in a fixed order,
+ * so the accumulated normal equations are bit-identical whatever the number of threads.
+ */
+
+template<typename T, int B = 3>
+struct TPairChunks
+{
+	/** The ranges [begin, end) of correspondences of the chunks, those of each sensor pair being contiguous. */
+	std::vector<std::array<size_t,2>> ranges;
+
+	/** The first chunk of each sensor pair, followed by the total number of chunks. */
+	std::vector<size_t> pair_first;
+
+	/** The partial normal equations of each chunk. */
+	std::vector<TPairSystem<T,B>,Eigen::aligned_allocator<TPairSystem<T,B>>> systems;
+
+	/** Splits the ranges of correspondences of the sensor pairs in chunks of at most chunk_size. */
+	void init(const std::vector<std::array<size_t,2>> &pair_ranges, const size_t &chunk_size)
+	{
+		ranges.clear();
+		pair_first.clear();
+		for(const std::array<size_t,2> &pair_range : pair_ranges)
+		{
+			pair_first.push_back(ranges.size());
+			for(size_t begin = pair_range[0]; begin < pair_range[1]; begin += chunk_size)
+				ranges.push_back(std::array<size_t,2>{begin, std::min(begin + chunk_size, pair_range[1])});
+		}
+
+		pair_first.push_back(ranges.size());
+		systems.resize(ranges.size());
+	}
+
+	/** Sums the chunks of a sensor pair through a binary tree, in a fixed order. */
+	void reduce(const size_t &pair, TPairSystem<T,B> &system)
+	{
+		const size_t first = pair_first[pair], count = pair_first[pair+1] - first;
+		if(count == 0)
+		{
+			system.setZero();
+			return;
+		}
+
+		for(size_t stride = 1; stride < count; stride *= 2)
+			for(size_t k = 0; k + stride < count; k += 2 * stride)
+				systems[first + k] += systems[first + k + stride];
+
+		system = systems[first];
+	}
+};
+
+/**
+ * \brief Normal equations of a rig, stored as the BxB blocks of the observed sensor pairs only.
+ *
+ * The first sensor is the fixed reference, so sensor s owns the parameters [B(s-1), Bs) and the blocks of the first sensor are dropped.
+ * Small rigs are solved by a dense LDLT factorization. From sparse_min_sensors sensors on, the blocks are written into a sparse matrix
+ * whose pattern (and its fill-reducing ordering) is analyzed once in init(), and only the numeric factorization is repeated by solve().
+ */
+
+template<typename T, int B = 3>
+class CBlockHessian
+{
+  public:
+
+	typedef T Scalar;
+	typedef Eigen::Matrix<T,Eigen::Dynamic,1> Vector;
+
+	/**
+	 * Sets up the blocks of the given sensor pairs, all of them zero.
+	 * \param num_sensors the number of sensors of the rig.
+	 * \param sensor_pairs the observed sensor pairs, each with sensor_i < sensor_j.
+	 * \param sparse_min_sensors the number of sensors from which the sparse factorization is used.
+	 */
+	void init(const int &num_sensors, const std::vector<std::pair<int,int>> &sensor_pairs, const int &sparse_min_sensors)
+	{
+		m_dof = B * std::max(0, num_sensors - 1);
+		m_block_index.clear();
+		m_block_sensors.clear();
+
+		for(int s = 1; s < num_sensors; s++)
+			addBlockIndex(s, s);
+		for(const std::pair<int,int> &sensor_pair : sensor_pairs)
+			if(sensor_pair.first != 0)
+				addBlockIndex(sensor_pair.first, sensor_pair.second);
+
+		m_blocks.resize(m_block_sensors.size());
+		m_gradient.resize(m_dof);
+		m_sparse = (num_sensors >= sparse_min_sensors);
+
+		if(m_sparse)
+		{
+			// The full symmetric pattern is stored; the factorization only reads its lower triangle
+			std::vector<Eigen::Triplet<T>> triplets;
+			for(const std::array<int,2> &sensors : m_block_sensors)
+				for(int r = 0; r < B; r++)
+					for(int c = 0; c < B; c++)
+					{
+						triplets.push_back(Eigen::Triplet<T>(B * (sensors[0] - 1) + r, B * (sensors[1] - 1) + c, 0));
+						triplets.push_back(Eigen::Triplet<T>(B * (sensors[1] - 1) + c, B * (sensors[0] - 1) + r, 0));
+					}
+
+			m_matrix.resize(m_dof, m_dof);
+			m_matrix.setFromTriplets(triplets.begin(), triplets.end());
+			m_matrix.makeCompressed();
+
+			// The position of each block entry, and of its transpose, in the values of the sparse matrix
+			m_value_offsets.resize(m_block_sensors.size());
+			for(size_t b = 0; b < m_block_sensors.size(); b++)
+				for(int r = 0; r < B; r++)
+					for(int c = 0; c < B; c++)
+					{
+						const int row = B * (m_block_sensors[b][0] - 1) + r, col = B * (m_block_sensors[b][1] - 1) + c;
+						m_value_offsets[b][0][B*r+c] = &m_matrix.coeffRef(row, col) - m_matrix.valuePtr();
+						m_value_offsets[b][1][B*r+c] = &m_matrix.coeffRef(col, row) - m_matrix.valuePtr();
+					}
+
+			m_sparse_ldlt.analyzePattern(m_matrix);
+		}
+
+		setZero();
+	}
+
+	void setZero()
+	{
+		for(Eigen::Matrix<T,B,B> &block : m_blocks)
+			block.setZero();
+		m_gradient.setZero();
+	}
+
+	/** Adds a block H_ij, with sensor_i <= sensor_j; its transpose H_ji is implied. */
+	void add(const int &sensor_i, const int &sensor_j, const Eigen::Matrix<T,B,B> &block)
+	{
+		if(sensor_i == 0)
+			return;
+
+		auto it = m_block_index.find(std::make_pair(sensor_i, sensor_j));
+		if(it != m_block_index.end())
+			m_blocks[it->second] += block;
+	}
+
+	/** Adds the gradient of a sensor. */
+	void addGradient(const int &sensor, const Eigen::Matrix<T,B,1> &gradient)
+	{
+		if(sensor != 0)
+			m_gradient.template segment<B>(B * (sensor - 1)) += gradient;
+	}
+
+	/** Adds the contribution of the correspondences of a sensor pair. */
+	void add(const int &sensor_i, const int &sensor_j, const TPairSystem<T,B> &system)
+	{
+		add(sensor_i, sensor_i, system.h_ii);
+		add(sensor_j, sensor_j, system.h_jj);
+		add(sensor_i, sensor_j, system.h_ij);
+		addGradient(sensor_i, system.g_i);
+		addGradient(sensor_j, system.g_j);
+	}
+
+	/**
+	 * Solves H x = -g through an LDLT factorization.
+	 * \param update the solution x.
+	 * \param conditioning the ratio of the smallest to the largest pivot of the factorization, an estimate of the conditioning of H.
+	 * \param min_conditioning the smallest conditioning accepted.
+	 * \return false when H is singular or its conditioning is below min_conditioning.
+	 */
+	bool solve(Vector &update, T &conditioning, const double &min_conditioning)
+	{
+		conditioning = 0;
+		if(m_dof == 0)
+			return false;
+
+		Eigen::Matrix<T,Eigen::Dynamic,1> pivots;
+		if(m_sparse)
+		{
+			T *values = m_matrix.valuePtr();
+			for(size_t b = 0; b < m_blocks.size(); b++)
+				for(int e = 0; e < B * B; e++)
+					values[m_value_offsets[b][0][e]] = values[m_value_offsets[b][1][e]] = m_blocks[b](e / B, e % B);
+
+			m_sparse_ldlt.factorize(m_matrix);
+			if(m_sparse_ldlt.info() != Eigen::Success)
+				return false;
+
+			pivots = m_sparse_ldlt.vectorD();
+			update = m_sparse_ldlt.solve(-m_gradient);
+		}
+
+		else
+		{
+			Eigen::Matrix<T,Eigen::Dynamic,Eigen::Dynamic> dense = Eigen::Matrix<T,Eigen::Dynamic,Eigen::Dynamic>::Zero(m_dof, m_dof);
+			for(size_t b = 0; b < m_blocks.size(); b++)
+			{
+				const int pos_i = B * (m_block_sensors[b][0] - 1), pos_j = B * (m_block_sensors[b][1] - 1);
+				dense.template block<B,B>(pos_i, pos_j) = m_blocks[b];
+				dense.template block<B,B>(pos_j, pos_i) = m_blocks[b].transpose();
+			}
+
+			Eigen::LDLT<Eigen::Matrix<T,Eigen::Dynamic,Eigen::Dynamic>> ldlt(dense);
+			if(ldlt.info() != Eigen::Success)
+				return false;
+
+			pivots = ldlt.vectorD();
+			update = ldlt.solve(-m_gradient);
+		}
+
+		if(pivots.maxCoeff() <= 0)
+			return false;
+
+		conditioning = std::max(T(0), pivots.minCoeff()) / pivots.maxCoeff();
+		return conditioning >= min_conditioning;
+	}
+
+  private:
+
+	void addBlockIndex(const int &sensor_i, const int &sensor_j)
+	{
+		if(m_block_index.count(std::make_pair(sensor_i, sensor_j)))
+			return;
+
+		m_block_index[std::make_pair(sensor_i, sensor_j)] = m_block_sensors.size();
+		m_block_sensors.push_back(std::array<int,2>{sensor_i, sensor_j});
+	}
+
+	/** The number of parameters, B per sensor but the first. */
+	int m_dof = 0;
+
+	/** The index of the block of each sensor pair, with the diagonal blocks first. */
+	std::map<std::pair<int,int>,size_t> m_block_index;
+	std::vector<std::array<int,2>> m_block_sensors;
+
+	std::vector<Eigen::Matrix<T,B,B>,Eigen::aligned_allocator<Eigen::Matrix<T,B,B>>> m_blocks;
+	Eigen::Matrix<T,Eigen::Dynamic,1> m_gradient;
+
+	/** Whether the sparse factorization is used, with its matrix and the offsets of the block entries in its values. */
+	bool m_sparse = false;
+	Eigen::SparseMatrix<T> m_matrix;
+	std::vector<std::array<std::array<int,B*B>,2>> m_value_offsets;
+	Eigen::SimplicialLDLT<Eigen::SparseMatrix<T>> m_sparse_ldlt;
+};
+
+/**
+ * \brief Normal equations of a rig with a number of sensors known at compile time, with the same interface as CBlockHessian.
+ *
+ * The Hessian is a fixed-size Eigen::Matrix<T,B(N-1),B(N-1)> factorized by a fixed-size LDLT, so that the iterations of a solver
+ * need no heap allocation and the block operations are unrolled. It suits the common small rigs, whose Hessians are dense anyway.
+ */
+
+template<typename T, int N, int B = 3>
+class CFixedHessian
+{
+  public:
+
+	static constexpr int dof = B * (N - 1);
+	typedef T Scalar;
+	typedef Eigen::Matrix<T,dof,1> Vector;
+
+	/** Resets the system; the rig must have N sensors, and all of its pairs get blocks. */
+	void init(const int &num_sensors, const std::vector<std::pair<int,int>> &sensor_pairs, const int &sparse_min_sensors)
+	{
+		setZero();
+	}
+
+	void setZero()
+	{
+		m_hessian.setZero();
+		m_gradient.setZero();
+	}
+
+	/** Adds a block H_ij, with sensor_i <= sensor_j; its transpose H_ji is implied. */
+	void add(const int &sensor_i, const int &sensor_j, const Eigen::Matrix<T,B,B> &block)
+	{
+		if(sensor_i == 0)
+			return;
+
+		m_hessian.template block<B,B>(B * (sensor_i - 1), B * (sensor_j - 1)) += block;
+		if(sensor_i != sensor_j)
+			m_hessian.template block<B,B>(B * (sensor_j - 1), B * (sensor_i - 1)) += block.transpose();
+	}
+
+	/** Adds the gradient of a sensor. */
+	void addGradient(const int &sensor, const Eigen::Matrix<T,B,1> &gradient)
+	{
+		if(sensor != 0)
+			m_gradient.template segment<B>(B * (sensor - 1)) += gradient;
+	}
+
+	/** Adds the contribution of the correspondences of a sensor pair. */
+	void add(const int &sensor_i, const int &sensor_j, const TPairSystem<T,B> &system)
+	{
+		add(sensor_i, sensor_i, system.h_ii);
+		add(sensor_j, sensor_j, system.h_jj);
+		add(sensor_i, sensor_j, system.h_ij);
+		addGradient(sensor_i, system.g_i);
+		addGradient(sensor_j, system.g_j);
+	}
+
+	/** Solves H x = -g, as CBlockHessian::solve(). */
+	bool solve(Vector &update, T &conditioning, const double &min_conditioning)
+	{
+		conditioning = 0;
+
+		Eigen::LDLT<Eigen::Matrix<T,dof,dof>> ldlt(m_hessian);
+		if(ldlt.info() != Eigen::Success)
+			return false;
+
+		const Vector pivots = ldlt.vectorD();
+		if(pivots.maxCoeff() <= 0)
+			return false;
+
+		update = ldlt.solve(-m_gradient);
+		conditioning = std::max(T(0), pivots.minCoeff()) / pivots.maxCoeff();
+		return conditioning >= min_conditioning;
+	}
+
+  private:
+
+	Eigen::Matrix<T,dof,dof> m_hessian;
+	Vector m_gradient;
+};
@@ -248,37 +248,36 @@ void CCalibFromLines::segmentLines(const cv::Mat &image, Eigen::MatrixXf &range,
 	}
 }
 
-void CCalibFromLines::findPotentialMatches(const std::vector<std::vector<CLine>> &lines, const int &set_id)
+void CCalibFromLines::findPotentialMatches(const std::vector<const std::vector<CLine>*> &lines, const int &set_id, std::map<int,std::map<int,std::vector<std::array<int,3>>>> &corresp)
 {
-	std::vector<Eigen::Vector2f> sensor_pose_uncertainties = sync_model->getSensorUncertainties();
+	const std::vector<Eigen::Matrix4f> sensor_poses = sync_model->getSensorPoses();
+	const std::vector<Eigen::Vector2f> sensor_pose_uncertainties = sync_model->getSensorUncertainties();
 
-	for(int i = 0; i < lines.size()-1; ++i)
+	for(int i = 0; i < static_cast<int>(lines.size()) - 1; ++i)
 		for(int j = i+1; j < lines.size(); ++j)
 		{
-			for(int ii = 0; ii < lines[i].size(); ++ii)
+			if(!lines[i] || !lines[j])
+				continue;
+
+			const Eigen::Matrix3f rot_i = sensor_poses[i].block(0,0,3,3);
+			const Eigen::Matrix3f rot_j = sensor_poses[j].block(0,0,3,3);
+
+			for(int ii = 0; ii < lines[i]->size(); ++ii)
 			{
-				for(int jj = 0; jj < lines[j].size(); ++jj)
-				{
-					Eigen::Vector3f n_ii = sync_model->getSensorPoses()[i].block(0,0,3,3) * lines[i][ii].normal;
-					Eigen::Vector3f v_ii = sync_model->getSensorPoses()[i].block(0,0,3,3) * lines[i][ii].v;
+				Eigen::Vector3f n_ii = rot_i * (*lines[i])[ii].normal;
 
-					Eigen::Vector3f n_jj = sync_model->getSensorPoses()[j].block(0,0,3,3) * lines[j][jj].normal;
-					Eigen::Vector3f v_jj = sync_model->getSensorPoses()[j].block(0,0,3,3) * lines[j][jj].v;
+				for(int jj = 0; jj < lines[j]->size(); ++jj)
+				{
+					Eigen::Vector3f n_jj = rot_j * (*lines[j])[jj].normal;
+					Eigen::Vector3f v_jj = rot_j * (*lines[j])[jj].v;
 
 					if((n_ii.dot(n_jj) > cos(sensor_pose_uncertainties[j](0) * (M_PI/180))) && (n_ii.dot(v_jj) < cos((90 - sensor_pose_uncertainties[j](0)) * (M_PI/180))))
 					{
 						std::array<int,3> potential_match{set_id, ii, jj};
-						mmv_line_corresp[i][j].push_back(potential_match);
+						corresp[i][j].push_back(potential_match);
 					}
 				}
 			}
-
-//			for stats printing when no matches exist
-//			if((lines[i].size() == 0) || (lines[j].size() == 0))
-//			{
-//				std::array<int,3> temp_match{-1, -1, -1};
-//				mmv_line_corresp[i][j].push_back(temp_match);
-//			}
 		}
 }
 
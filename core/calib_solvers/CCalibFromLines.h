@@ -44,11 +44,13 @@ protected:
 
 	/**
 	 * Search for potential line matches between each sensor pair in a syc obs set.
-	 * \param lines lines extracted from sensor observations that belong to the same synchronized set. lines[sensor_id][line_id] gives a line.
+	 * \param lines lines extracted from sensor observations that belong to the same synchronized set. (*lines[sensor_id])[line_id] gives a line,
+	 * and lines[sensor_id] is null when the sensor has no observation in the set.
 	 * \param set_id the id of the synchronized set the lines belong to.
-	 * \param params the parameters for line matching.
+	 * \param corresp the correspondences found are appended here, in the same layout as mmv_line_corresp.
+	 * The method only writes to this output, so different sets can be matched concurrently.
 	 */
-	void findPotentialMatches(const std::vector<std::vector<CLine>> &lines, const int &set_id);
+	void findPotentialMatches(const std::vector<const std::vector<CLine>*> &lines, const int &set_id, std::map<int,std::map<int,std::vector<std::array<int,3>>>> &corresp);
 
 	/** Calculate the angular residual error of the correspondences.
 	 * \return the residual
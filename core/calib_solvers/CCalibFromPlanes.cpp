@@ -9,16 +9,23 @@
    +------------------------------------------------------------------------+ */
 
 #include "CCalibFromPlanes.h"
+#include <COrganizedNormalEstimation.h>
+#include <CNormalSphereIndex.h>
+#include <Utils.h>
 #include <mrpt/poses/CPose3D.h>
 
-#include <mrpt/pbmap/PbMap.h>
-
 #include <pcl/search/impl/search.hpp>
 #include <pcl/segmentation/organized_multi_plane_segmentation.h>
 #include <pcl/ModelCoefficients.h>
 #include <pcl/features/normal_3d.h>
 #include <pcl/features/integral_image_normal.h>
-#include <pcl/filters/extract_indices.h>
+
+#include <atomic>
+#include <limits>
+#include <random>
+#include <set>
+#include <thread>
+#include <tuple>
 
 using namespace std;
 
@@ -40,22 +47,35 @@ void CCalibFromPlanes::segmentPlanes(const pcl::PointCloud<pcl::PointXYZRGBA>::P
 {
 	unsigned min_inliers = params->seg.min_inliers_frac * cloud->size();
 
-	pcl::IntegralImageNormalEstimation<pcl::PointXYZRGBA, pcl::Normal> normal_estimation;
-
-	if(params->seg.normal_estimation_method == 0)
-		normal_estimation.setNormalEstimationMethod(normal_estimation.COVARIANCE_MATRIX);
-	else if(params->seg.normal_estimation_method == 1)
-		normal_estimation.setNormalEstimationMethod(normal_estimation.AVERAGE_3D_GRADIENT);
-	else
-		normal_estimation.setNormalEstimationMethod(normal_estimation.AVERAGE_DEPTH_CHANGE);
+	pcl::PointCloud<pcl::Normal>::Ptr normal_cloud(new pcl::PointCloud<pcl::Normal>);
 
-	normal_estimation.setDepthDependentSmoothing(params->seg.depth_dependent_smoothing);
-	normal_estimation.setMaxDepthChangeFactor(params->seg.max_depth_change_factor);
-	normal_estimation.setNormalSmoothingSize(params->seg.normal_smoothing_size);
+	if(params->seg.normal_estimation_method == 3)
+	{
+		COrganizedNormalEstimation normal_estimation;
+		normal_estimation.setDepthDependentSmoothing(params->seg.depth_dependent_smoothing);
+		normal_estimation.setMaxDepthChangeFactor(params->seg.max_depth_change_factor);
+		normal_estimation.setNormalSmoothingSize(params->seg.normal_smoothing_size);
+		normal_estimation.setInputCloud(cloud);
+		normal_estimation.compute(*normal_cloud);
+	}
 
-	pcl::PointCloud<pcl::Normal>::Ptr normal_cloud(new pcl::PointCloud<pcl::Normal>);
-	normal_estimation.setInputCloud(cloud);
-	normal_estimation.compute(*normal_cloud);
+	else
+	{
+		pcl::IntegralImageNormalEstimation<pcl::PointXYZRGBA, pcl::Normal> normal_estimation;
+
+		if(params->seg.normal_estimation_method == 0)
+			normal_estimation.setNormalEstimationMethod(normal_estimation.COVARIANCE_MATRIX);
+		else if(params->seg.normal_estimation_method == 1)
+			normal_estimation.setNormalEstimationMethod(normal_estimation.AVERAGE_3D_GRADIENT);
+		else
+			normal_estimation.setNormalEstimationMethod(normal_estimation.AVERAGE_DEPTH_CHANGE);
+
+		normal_estimation.setDepthDependentSmoothing(params->seg.depth_dependent_smoothing);
+		normal_estimation.setMaxDepthChangeFactor(params->seg.max_depth_change_factor);
+		normal_estimation.setNormalSmoothingSize(params->seg.normal_smoothing_size);
+		normal_estimation.setInputCloud(cloud);
+		normal_estimation.compute(*normal_cloud);
+	}
 
 	pcl::OrganizedMultiPlaneSegmentation<pcl::PointXYZRGBA, pcl::Normal, pcl::Label> multi_plane_segmentation;
 	multi_plane_segmentation.setMinInliers(min_inliers);
@@ -65,7 +85,6 @@ void CCalibFromPlanes::segmentPlanes(const pcl::PointCloud<pcl::PointXYZRGBA>::P
 	multi_plane_segmentation.setInputCloud(cloud);
 
 	std::vector<pcl::PlanarRegion<pcl::PointXYZRGBA>, Eigen::aligned_allocator<pcl::PlanarRegion<pcl::PointXYZRGBA>>> regions;
-	std::vector<pcl::PlanarRegion<pcl::PointXYZRGBA>, Eigen::aligned_allocator<pcl::PlanarRegion<pcl::PointXYZRGBA>>> unique_regions;
 	std::vector<pcl::ModelCoefficients> model_coefficients;
 	std::vector<pcl::PointIndices> inlier_indices;
 	pcl::PointCloud<pcl::Label>::Ptr labels(new pcl::PointCloud<pcl::Label>);
@@ -74,367 +93,1800 @@ void CCalibFromPlanes::segmentPlanes(const pcl::PointCloud<pcl::PointXYZRGBA>::P
 
 	multi_plane_segmentation.segmentAndRefine(regions, model_coefficients, inlier_indices, labels, label_indices, boundary_indices);
 
-	// Create a vector with the planes detected in this frame, and calculate their parameters (normal, center, pointclouds, etc.)
+	// Create a vector with the planes detected in this frame, and calculate their parameters (normal, center, covariance, contour).
+	// Regions of the same plane (this situation may happen when there exists a small discontinuity in the observation) are merged.
 
-	mrpt::pbmap::PbMap pbmap;
+	planes.clear();
+	std::vector<std::vector<int>> plane_inliers; // kept aligned with planes
 
 	for (size_t i = 0; i < regions.size(); i++)
 	{
-		CPlaneCHull planehull;
-
 		if(regions[i].getCurvature() > params->seg.max_curvature)
 			continue;
 
-		mrpt::pbmap::Plane plane;
-		plane.v3center = regions[i].getCentroid ();
-		plane.v3normal = Eigen::Vector3f(model_coefficients[i].values[0], model_coefficients[i].values[1], model_coefficients[i].values[2]);
-		plane.d = model_coefficients[i].values[3];
-
-		// Force the normal vector to point towards the camera
-		if( model_coefficients[i].values[3] < 0)
-		{
-			plane.v3normal = -plane.v3normal;
-			plane.d = -plane.d;
-		}
-
-		plane.curvature = regions[i].getCurvature();
+		CPlaneCHull plane;
+		for(const int &index : inlier_indices[i].indices)
+			plane.moments.addPoint(cloud->points[index]);
+		plane.calcPlaneFromMoments();
 
-		// Extract the planar inliers from the input cloud
-		pcl::ExtractIndices<pcl::PointXYZRGBA> extract;
-		extract.setInputCloud ( cloud );
-		extract.setIndices ( boost::make_shared<const pcl::PointIndices> (inlier_indices[i]) );
-		extract.setNegative (false);
-		extract.filter (*plane.planePointCloudPtr);
-		plane.inliers = inlier_indices[i].indices;
-
-		pcl::PointCloud<pcl::PointXYZRGBA>::Ptr contourPtr(new pcl::PointCloud<pcl::PointXYZRGBA>);
-		contourPtr->points = regions[i].getContour();
-		plane.calcConvexHull(contourPtr);
-
-		// Check whether this region correspond to the same plane as a previous one (this situation may happen when there exists a small discontinuity in the observation)
+		plane.contour_cloud.reset(new pcl::PointCloud<pcl::PointXYZRGBA>);
+		plane.contour_cloud->points = regions[i].getContour();
+		plane.v_contour_indices = boundary_indices[i].indices;
 
 		bool isSamePlane = false;
-		for (size_t j = 0; j < pbmap.vPlanes.size(); j++)
-			if(pbmap.vPlanes[j].isSamePlane(plane, params->seg.max_cos_normal, params->seg.dist_centre_plane_threshold, params->seg.proximity_threshold))
+		for (size_t j = 0; j < planes.size(); j++)
+			if(planes[j].isSamePlane(plane, params->seg.max_cos_normal, params->seg.dist_centre_plane_threshold, params->seg.proximity_threshold))
 			{
 				isSamePlane = true;
-				pbmap.vPlanes[j].mergePlane(plane);
-				boundary_indices.erase(boundary_indices.begin() + j);
+				planes[j].moments += plane.moments;
+				planes[j].calcPlaneFromMoments();
+				planes[j].mergeContour(plane);
+				plane_inliers[j].insert(plane_inliers[j].end(), inlier_indices[i].indices.begin(), inlier_indices[i].indices.end());
 				break;
 			}
 
 		if(!isSamePlane)
 		{
-			pbmap.vPlanes.push_back(plane);
-			unique_regions.push_back(regions[i]);
+			planes.push_back(plane);
+			plane_inliers.push_back(inlier_indices[i].indices);
 		}
 	}
 
-	pcl::PointCloud<pcl::PointXYZRGBA>::Ptr contourPtr(new pcl::PointCloud<pcl::PointXYZRGBA>);
-	planes.resize(pbmap.vPlanes.size());
-	for (size_t i = 0; i < pbmap.vPlanes.size (); i++)
+	for (size_t i = 0; i < planes.size(); i++)
+		planes[i].v_inliers = CInlierMask(plane_inliers[i]);
+}
+
+Scalar CCalibFromPlanes::trackPlanes(const pcl::PointCloud<pcl::PointXYZRGBA>::Ptr &cloud, const std::vector<CPlaneCHull> &prev_planes, std::vector<CPlaneCHull> &planes)
+{
+	// The previous plane is searched within a wider band than the segmentation's, to allow for the motion between observations
+	const Scalar tracking_threshold = params->seg.tracking_dist_factor * params->seg.dist_threshold;
+	const size_t min_inliers = params->seg.min_inliers_frac * cloud->size();
+
+	std::vector<int> labels(cloud->size(), -1);
+	size_t prev_inliers_count = 0, tracked_inliers_count = 0;
+	planes.clear();
+
+	for(const CPlaneCHull &prev_plane : prev_planes)
 	{
-		planes[i].v3normal = pbmap.vPlanes[i].v3normal;
-		planes[i].v3center = pbmap.vPlanes[i].v3center;
-		planes[i].d = pbmap.vPlanes[i].d;
+		prev_inliers_count += prev_plane.v_inliers.size();
+
+		// Check the predicted inlier mask first
+		CPlaneCHull plane;
+		std::vector<int> candidates;
+		for(const int &index : prev_plane.v_inliers)
+		{
+			const pcl::PointXYZRGBA &point = cloud->points[index];
+			if(labels[index] == -1 && std::isfinite(point.z)
+			        && std::abs(prev_plane.v3normal.dot(point.getVector3fMap()) + prev_plane.d) < tracking_threshold)
+			{
+				candidates.push_back(index);
+				plane.moments.addPoint(point);
+			}
+		}
 
-		planes[i].ConvexHullPtr = pbmap.vPlanes[i].polygonContourPtr;
-		planes[i].v_inliers = pbmap.vPlanes[i].inliers;
+		if(candidates.size() < min_inliers)
+			continue;
 
+		// Refit the plane to the candidates and keep the ones that lie on it as seeds
+		plane.calcPlaneFromMoments();
+		std::vector<int> seeds;
+		for(const int &index : candidates)
+			if(std::abs(plane.v3normal.dot(cloud->points[index].getVector3fMap()) + plane.d) < params->seg.dist_threshold)
+				seeds.push_back(index);
 
-		contourPtr->points = unique_regions[i].getContour();
-		pbmap.vPlanes[i].calcConvexHull(contourPtr, planes[i].v_hull_indices);
-		for (size_t j = 0; j < planes[i].v_hull_indices.size(); j++)
-			planes[i].v_hull_indices[j] = boundary_indices[i].indices[planes[i].v_hull_indices[j]];
+		if(growPlane(cloud, seeds, plane, labels, planes.size()))
+		{
+			tracked_inliers_count += seeds.size();
+			planes.push_back(plane);
+		}
 	}
+
+	if(prev_inliers_count == 0)
+		return 0;
+
+	return static_cast<Scalar>(tracked_inliers_count) / prev_inliers_count;
 }
 
-void CCalibFromPlanes::findPotentialMatches(const std::vector<std::vector<CPlaneCHull>> &planes, const int &set_id)
+void CCalibFromPlanes::segmentPlanesGuided(const pcl::PointCloud<pcl::PointXYZRGBA>::Ptr &cloud, const int &sensor_id, const mrpt::img::TCamera &camera,
+                                           const std::vector<CPlaneCHull> &ref_planes, std::vector<CPlaneCHull> &planes)
 {
-	std::vector<Eigen::Vector2f> sensor_pose_uncertainties = sync_model->getSensorUncertainties();
+	const std::vector<Eigen::Matrix4f> sensor_poses = sync_model->getSensorPoses();
+	const Eigen::Vector2f uncertainty = sync_model->getSensorUncertainties()[sensor_id];
+	const Scalar sin_angle = sin(uncertainty(0) * (M_PI/180));
+	const Scalar cos_angle = cos(uncertainty(0) * (M_PI/180));
+	const Scalar tan_angle = tan(uncertainty(0) * (M_PI/180));
+	const size_t min_inliers = params->seg.min_inliers_frac * cloud->size();
+	const int width = cloud->width, height = cloud->height;
+
+	const Eigen::Matrix3f ref_rot = sensor_poses[0].block(0,0,3,3);
+	const Eigen::Vector3f ref_trans = sensor_poses[0].block(0,3,3,1);
+	const Eigen::Matrix3f rot = sensor_poses[sensor_id].block(0,0,3,3);
+	const Eigen::Vector3f trans = sensor_poses[sensor_id].block(0,3,3,1);
+
+	std::vector<int> labels(cloud->size(), -1);
+	std::mt19937 rng(sensor_id);
+	planes.clear();
+
+	// Subsamples the given pixels to at most guided_max_ransac_samples
+	auto subsample = [&](const std::vector<int> &pixels, std::vector<int> &samples)
+	{
+		samples.clear();
+		const size_t stride = std::max<size_t>(1, pixels.size() / std::max(1, params->seg.guided_max_ransac_samples));
+		for(size_t k = 0; k < pixels.size(); k += stride)
+			samples.push_back(pixels[k]);
+	};
+
+	// Keeps the hypothesis, given by three pixels, with the most samples within the segmentation distance threshold
+	auto scoreHypothesis = [&](const int &i1, const int &i2, const int &i3, const std::vector<int> &samples, const Eigen::Vector3f *prior_normal,
+	                           CPlaneCHull &best_plane, size_t &best_score)
+	{
+		Eigen::Vector3f p1 = cloud->points[i1].getVector3fMap();
+		Eigen::Vector3f normal = (cloud->points[i2].getVector3fMap() - p1).cross(cloud->points[i3].getVector3fMap() - p1);
+		if(!std::isfinite(normal.norm()) || normal.norm() < 1e-6)
+			return;
+		normal.normalize();
+
+		if(prior_normal != nullptr && std::abs(normal.dot(*prior_normal)) < cos_angle)
+			return;
+
+		Scalar dist = -normal.dot(p1);
+		size_t score = 0;
+		for(const int &index : samples)
+			if(std::abs(normal.dot(cloud->points[index].getVector3fMap()) + dist) < params->seg.dist_threshold)
+				score++;
+
+		if(score > best_score)
+		{
+			best_score = score;
+			best_plane.v3normal = normal;
+			best_plane.d = dist;
+		}
+	};
 
-	for(int i = 0; i < planes.size()-1; ++i)
-		for(int j = i+1; j < planes.size(); ++j)
+	std::vector<int> candidates, samples, seeds;
+	for(const CPlaneCHull &ref_plane : ref_planes)
+	{
+		// Predict the plane in the sensor's frame
+		Eigen::Vector3f n_world = ref_rot * ref_plane.v3normal;
+		Scalar d_world = ref_plane.d - ref_trans.dot(n_world);
+		Eigen::Vector3f n_pred = rot.transpose() * n_world;
+		Scalar d_pred = d_world + trans.dot(n_world);
+
+		// Only the bounding box of the reference hull projected into the image is searched, widened by the pose uncertainty.
+		// A vertex at depth z may move by up to f*(tan(angle) + dist/z) pixels; a hull behind the sensor, or without vertices, leaves the whole image.
+		const pcl::PointCloud<pcl::PointXYZRGBA>::Ptr &ref_hull = ref_plane.getConvexHull();
+		int min_c = width, max_c = -1, min_r = height, max_r = -1;
+		if(ref_hull->points.empty())
+		{
+			min_c = min_r = 0;
+			max_c = width - 1;
+			max_r = height - 1;
+		}
+
+		for(const pcl::PointXYZRGBA &ref_point : ref_hull->points)
 		{
-			for(int ii = 0; ii < planes[i].size(); ++ii)
+			const Eigen::Vector3f point = rot.transpose() * (ref_rot * ref_point.getVector3fMap() + ref_trans - trans);
+			if(point(2) <= 0)
 			{
-				for(int jj = 0; jj < planes[j].size(); ++jj)
-				{
-					Eigen::Vector3f n_ii = sync_model->getSensorPoses()[i].block(0,0,3,3) * planes[i][ii].v3normal;
-                    Scalar d1 = planes[i][ii].d - Eigen::Vector3f(sync_model->getSensorPoses()[i].block(0,3,3,1)).dot(n_ii);
-					Eigen::Vector3f n_jj = sync_model->getSensorPoses()[j].block(0,0,3,3) * planes[j][jj].v3normal;
-                    Scalar d2 = planes[j][jj].d - Eigen::Vector3f(sync_model->getSensorPoses()[j].block(0,3,3,1)).dot(n_jj);
-					if((n_ii.dot(n_jj) > cos(sensor_pose_uncertainties[j][0] * (M_PI/180))) && (d1 - d2 < sensor_pose_uncertainties[j][1]))
-					{
-						std::array<int,3> potential_match{set_id, ii, jj};
-						mmv_plane_corresp[i][j].push_back(potential_match);
-					}
-				}
+				min_c = min_r = 0;
+				max_c = width - 1;
+				max_r = height - 1;
+				break;
+			}
+
+			const Scalar u = camera.fx() * point(0) / point(2) + camera.cx(), v = camera.fy() * point(1) / point(2) + camera.cy();
+			const Scalar margin_u = camera.fx() * (tan_angle + uncertainty(1) / point(2)), margin_v = camera.fy() * (tan_angle + uncertainty(1) / point(2));
+			min_c = std::min<int>(min_c, std::max<Scalar>(0, std::floor(u - margin_u)));
+			max_c = std::max<int>(max_c, std::min<Scalar>(width - 1, std::ceil(u + margin_u)));
+			min_r = std::min<int>(min_r, std::max<Scalar>(0, std::floor(v - margin_v)));
+			max_r = std::max<int>(max_r, std::min<Scalar>(height - 1, std::ceil(v + margin_v)));
+		}
+
+		// A point at range r may be displaced by up to r*sin(angle) by the angular uncertainty
+		candidates.clear();
+		for(int r = min_r; r <= max_r; r++)
+			for(int c = min_c; c <= max_c; c++)
+			{
+				const int index = r * width + c;
+				const pcl::PointXYZRGBA &point = cloud->points[index];
+				if(labels[index] == -1 && std::isfinite(point.z)
+				        && std::abs(n_pred.dot(point.getVector3fMap()) + d_pred) < uncertainty(1) + point.getVector3fMap().norm() * sin_angle)
+					candidates.push_back(index);
 			}
 
-//			// for stats printing when no matches exist
-//			if((planes[i].size() == 0) || (planes[j].size() == 0))
-//			{
-//				std::array<int,3> temp_match{-1, -1, -1};
-//				mmv_plane_corresp[i][j].push_back(temp_match);
-//			}
+		if(candidates.size() < min_inliers)
+			continue;
+
+		// RANSAC within the predicted band, on a subsample of the candidates, for planes compatible with the prediction
+		subsample(candidates, samples);
+		std::uniform_int_distribution<size_t> pick(0, samples.size() - 1);
+		CPlaneCHull best_plane;
+		size_t best_score = 0;
+		for(int it = 0; it < params->seg.guided_ransac_iters; it++)
+			scoreHypothesis(samples[pick(rng)], samples[pick(rng)], samples[pick(rng)], samples, &n_pred, best_plane, best_score);
+
+		if(best_score == 0)
+			continue;
+
+		seeds.clear();
+		for(const int &index : candidates)
+			if(std::abs(best_plane.v3normal.dot(cloud->points[index].getVector3fMap()) + best_plane.d) < params->seg.dist_threshold)
+				seeds.push_back(index);
+
+		if(growPlane(cloud, seeds, best_plane, labels, planes.size()))
+			planes.push_back(best_plane);
+	}
+
+	// The pixels that were not explained by the predictions are segmented by the same sampling and growing, when they are
+	// a large part of the observation. Each hypothesis is fitted to a leftover pixel and two others within the normal smoothing
+	// window around it, and the search stops after a few hypotheses in a row fail to grow into a plane.
+	std::vector<int> leftovers;
+	size_t valid_count = 0;
+	for(size_t index = 0; index < cloud->size(); index++)
+		if(std::isfinite(cloud->points[index].z))
+		{
+			valid_count++;
+			if(labels[index] == -1)
+				leftovers.push_back(index);
+		}
+
+	if(leftovers.size() <= params->seg.guided_leftover_frac * valid_count)
+		return;
+
+	const int window = std::max(1, int(params->seg.normal_smoothing_size));
+	std::uniform_int_distribution<int> offset(-window, window);
+	auto pickNeighbour = [&](const int &index)
+	{
+		const int r = index / width + offset(rng), c = index % width + offset(rng);
+		if(r < 0 || r >= height || c < 0 || c >= width)
+			return index;
+		const int neighbour = r * width + c;
+		return (labels[neighbour] == -1 && std::isfinite(cloud->points[neighbour].z)) ? neighbour : index;
+	};
+
+	for(int failures = 0; failures < params->seg.guided_max_failures;)
+	{
+		leftovers.erase(std::remove_if(leftovers.begin(), leftovers.end(), [&](const int &index){ return labels[index] != -1; }), leftovers.end());
+		if(leftovers.size() < min_inliers)
+			break;
+
+		subsample(leftovers, samples);
+		std::uniform_int_distribution<size_t> pick(0, samples.size() - 1);
+		CPlaneCHull best_plane;
+		size_t best_score = 0;
+		for(int it = 0; it < params->seg.guided_ransac_iters; it++)
+		{
+			const int index = samples[pick(rng)];
+			scoreHypothesis(index, pickNeighbour(index), pickNeighbour(index), samples, nullptr, best_plane, best_score);
+		}
+
+		seeds.clear();
+		if(best_score > 0)
+			for(const int &index : samples)
+				if(std::abs(best_plane.v3normal.dot(cloud->points[index].getVector3fMap()) + best_plane.d) < params->seg.dist_threshold)
+					seeds.push_back(index);
+
+		if(!seeds.empty() && growPlane(cloud, seeds, best_plane, labels, planes.size()))
+		{
+			planes.push_back(best_plane);
+			failures = 0;
 		}
+		else
+			failures++;
+	}
 }
 
-Scalar CCalibFromPlanes::computeRotationResidual()
+bool CCalibFromPlanes::growPlane(const pcl::PointCloud<pcl::PointXYZRGBA>::Ptr &cloud, const std::vector<int> &seeds, CPlaneCHull &plane, std::vector<int> &labels, const int &label)
 {
-	std::vector<Eigen::Matrix4f> sensor_poses = sync_model->getSensorPoses();
-	Scalar sum_squared_error = 0.; // Accumulated squared error for all plane correspondences
+	const int width = cloud->width;
+	const int height = cloud->height;
+	const size_t min_inliers = params->seg.min_inliers_frac * cloud->size();
 
-	for(std::map<int,std::map<int,std::vector<std::array<int,3>>>>::iterator it_sensor_i = mmv_plane_corresp.begin();
-	    it_sensor_i != mmv_plane_corresp.end(); it_sensor_i++)
+	auto isInlier = [&](const int &index)
 	{
-		size_t sensor_i = it_sensor_i->first;
-		for(std::map<int,std::vector<std::array<int,3>>>::iterator it_sensor_j = it_sensor_i->second.begin();
-		    it_sensor_j != it_sensor_i->second.end(); it_sensor_j++)
+		const pcl::PointXYZRGBA &point = cloud->points[index];
+		return labels[index] == -1 && std::isfinite(point.z)
+		        && std::abs(plane.v3normal.dot(point.getVector3fMap()) + plane.d) < params->seg.dist_threshold;
+	};
+
+	std::vector<int> inliers;
+	for(const int &index : seeds)
+		if(isInlier(index))
 		{
-			size_t sensor_j = it_sensor_j->first;
-			std::vector<std::array<int,3>> &correspondences = it_sensor_j->second;
-			for(int i = 0; i < correspondences.size(); i++)
+			labels[index] = label;
+			inliers.push_back(index);
+		}
+
+	// Breadth-first growing, the inliers vector doubles as the queue
+	plane.moments = TPlaneMoments();
+	for(size_t i = 0; i < inliers.size(); i++)
+	{
+		const int index = inliers[i];
+		const int r = index / width, c = index % width;
+		plane.moments.addPoint(cloud->points[index]);
+
+		const int neighbours[4] = {c > 0 ? index - 1 : -1, c < width - 1 ? index + 1 : -1,
+		                           r > 0 ? index - width : -1, r < height - 1 ? index + width : -1};
+		for(const int &neighbour : neighbours)
+			if(neighbour != -1 && isInlier(neighbour))
 			{
-				int set_id = correspondences[i][0];
-				int sync_obs1_id = sync_model->findSyncIndexFromSet(set_id, sync_model->getSensorLabels()[sensor_i]);
-				int sync_obs2_id = sync_model->findSyncIndexFromSet(set_id, sync_model->getSensorLabels()[sensor_j]);
+				labels[neighbour] = label;
+				inliers.push_back(neighbour);
+			}
+	}
 
-				Eigen::Vector3f n_obs_i = mvv_planes[sensor_i][sync_obs1_id][correspondences[i][1]].v3normal;
-				Eigen::Vector3f n_obs_j = mvv_planes[sensor_j][sync_obs2_id][correspondences[i][2]].v3normal;
+	if(inliers.size() < min_inliers || plane.moments.curvature() > params->seg.max_curvature)
+	{
+		for(const int &index : inliers)
+			labels[index] = -1;
+		return false;
+	}
 
-				Eigen::Vector3f n_i = sensor_poses[sensor_i].block(0,0,3,3) * n_obs_i;
-				Eigen::Vector3f n_j = sensor_poses[sensor_j].block(0,0,3,3) * n_obs_j;
+	plane.calcPlaneFromMoments();
+	plane.v_inliers = CInlierMask(inliers);
 
-				Eigen::Vector3f rot_error = (n_i - n_j);
-				sum_squared_error += rot_error.dot(rot_error);
-			}
+	// The contour of the region is made of its boundary pixels, the convex hull is calculated from it on demand
+	plane.contour_cloud.reset(new pcl::PointCloud<pcl::PointXYZRGBA>);
+	plane.v_contour_indices.clear();
+	for(const int &index : inliers)
+	{
+		const int r = index / width, c = index % width;
+		if(c == 0 || c == width - 1 || r == 0 || r == height - 1 || labels[index - 1] != label
+		        || labels[index + 1] != label || labels[index - width] != label || labels[index + width] != label)
+		{
+			plane.v_contour_indices.push_back(index);
+			plane.contour_cloud->points.push_back(cloud->points[index]);
 		}
 	}
 
-	return sum_squared_error;
+	return true;
 }
 
-Scalar CCalibFromPlanes::computeRotation()
+void CCalibFromPlanes::computeSensorOverlap(const std::vector<mrpt::img::TCamera> &cameras, const std::vector<Scalar> &max_ranges)
 {
-	std::vector<Eigen::Matrix4f> sensor_poses = sync_model->getSensorPoses();
+	const std::vector<Eigen::Matrix4f> sensor_poses = sync_model->getSensorPoses();
+	const std::vector<Eigen::Vector2f> sensor_pose_uncertainties = sync_model->getSensorUncertainties();
 	const int num_sensors = sensor_poses.size();
-	const int dof = 3 * (num_sensors - 1);
-	Eigen::VectorXf update_vector(dof);
-	Eigen::Matrix3f jacobian_rot_i, jacobian_rot_j; // Jacobians of the rotation
-	float error, new_error, init_error;
-	float av_angle_error;
+	const int grid_size = 10, depth_steps = 10;
+	const Scalar min_range = 0.3;
 
-	std::vector<Eigen::Matrix4f> estimated_poses = sensor_poses;
-	std::vector<Eigen::Matrix4f> estimated_poses_temp(sensor_poses.size());
+	m_sensor_overlap.assign(num_sensors, std::vector<bool>(num_sensors, true));
+	mv_sensor_cameras = cameras;
+	mv_sensor_max_ranges = max_ranges;
 
-	float increment = 1000, diff_error = 1000;
-	int it = 0;
+	for(int i = 0; i < num_sensors; i++)
+		for(int j = i + 1; j < num_sensors; j++)
+		{
+			// Transformation from the frame of sensor i to that of sensor j, with the angular uncertainty of both widening the view of j
+			const Eigen::Matrix4f pose_ji = sensor_poses[j].inverse() * sensor_poses[i];
+			const Scalar angle_margin = (sensor_pose_uncertainties[i][0] + sensor_pose_uncertainties[j][0]) * (M_PI/180);
+			const Scalar dist_margin = sensor_pose_uncertainties[i][1] + sensor_pose_uncertainties[j][1];
+			const Scalar margin_u = cameras[j].fx() * tan(angle_margin), margin_v = cameras[j].fy() * tan(angle_margin);
+
+			// Without known ranges and intrinsics nothing can be predicted, and the pair is kept
+			if(max_ranges[i] <= min_range || max_ranges[j] <= min_range || cameras[i].ncols == 0 || cameras[j].ncols == 0)
+				continue;
+
+			// Sample the frustum of sensor i and look for any point that sensor j may also see
+			bool overlap = false;
+			for(int r = 0; r <= grid_size && !overlap; r++)
+				for(int c = 0; c <= grid_size && !overlap; c++)
+				{
+					Scalar u = c * (cameras[i].ncols - 1) / Scalar(grid_size), v = r * (cameras[i].nrows - 1) / Scalar(grid_size);
+					Eigen::Vector3f ray((u - cameras[i].cx()) / cameras[i].fx(), (v - cameras[i].cy()) / cameras[i].fy(), 1);
 
-	init_error = computeRotationResidual();
+					for(int k = 0; k <= depth_steps && !overlap; k++)
+					{
+						Scalar depth = min_range + k * (max_ranges[i] - min_range) / depth_steps;
+						Eigen::Vector3f point = pose_ji.block<3,3>(0,0) * (depth * ray) + pose_ji.block<3,1>(0,3);
+						if(point(2) <= 0 || point(2) > max_ranges[j] + dist_margin)
+							continue;
+
+						Scalar u_j = cameras[j].fx() * point(0) / point(2) + cameras[j].cx();
+						Scalar v_j = cameras[j].fy() * point(1) / point(2) + cameras[j].cy();
+						overlap = u_j > -margin_u && u_j < cameras[j].ncols + margin_u && v_j > -margin_v && v_j < cameras[j].nrows + margin_v;
+					}
+				}
 
-	while(it < params->solver.max_iters && increment > params->solver.min_update && diff_error > params->solver.converge_error)
+			m_sensor_overlap[i][j] = m_sensor_overlap[j][i] = overlap;
+		}
+}
+
+bool CCalibFromPlanes::sensorsOverlap(const int &sensor_i, const int &sensor_j) const
+{
+	return m_sensor_overlap.empty() || m_sensor_overlap[sensor_i][sensor_j];
+}
+
+size_t CCalibFromPlanes::findPotentialMatches(const std::vector<const std::vector<CPlaneCHull>*> &planes, const int &set_id, std::map<int,std::map<int,std::vector<std::array<int,3>>>> &corresp,
+                                              std::map<std::pair<int,int>,TSetPairMatches> *pair_matches, const Eigen::Vector2f *thresholds)
+{
+	const std::vector<Eigen::Matrix4f> sensor_poses = sync_model->getSensorPoses();
+	const std::vector<Eigen::Vector2f> sensor_pose_uncertainties = thresholds ? std::vector<Eigen::Vector2f>(sensor_poses.size(), *thresholds)
+	                                                                          : sync_model->getSensorUncertainties();
+
+	// Transform the planes of each sensor to the common frame once, as columns of a normals matrix and a distances row
+	std::vector<Eigen::Matrix<Scalar,3,Eigen::Dynamic>> normals(planes.size());
+	std::vector<Eigen::Matrix<Scalar,1,Eigen::Dynamic>> dists(planes.size());
+	std::vector<CNormalSphereIndex> normal_indices(planes.size());
+
+	// The convex hulls in the common frame and their bounding boxes, for the overlap test
+	std::vector<std::vector<Eigen::Matrix<Scalar,3,Eigen::Dynamic>>> hulls(planes.size());
+	std::vector<std::vector<Eigen::AlignedBox<Scalar,3>>> boxes(planes.size());
+	const Scalar margin = params->match.hull_overlap_margin;
+	for(size_t i = 0; i < planes.size(); ++i)
 	{
-		// Calculate the hessian and the gradient
-		hessian = Eigen::Matrix<Scalar,Eigen::Dynamic,Eigen::Dynamic>::Zero(dof, dof); // Hessian of the rotation of the decoupled system
-		gradient = Eigen::Matrix<Scalar,Eigen::Dynamic,1>::Zero(dof); // Gradient of the rotation of the decoupled system
-		error = 0.0;
-		av_angle_error = 0.0;
+		size_t plane_count = planes[i] ? planes[i]->size() : 0;
+		normals[i].resize(3, plane_count);
+		dists[i].resize(plane_count);
+		for(size_t k = 0; k < plane_count; ++k)
+		{
+			normals[i].col(k) = (*planes[i])[k].v3normal;
+			dists[i](k) = (*planes[i])[k].d;
+		}
+
+		normals[i] = sensor_poses[i].block<3,3>(0,0) * normals[i];
+		dists[i] -= sensor_poses[i].block<3,1>(0,3).transpose() * normals[i];
+
+		if(params->match.use_normal_index && i > 0)
+			normal_indices[i].build(normals[i], sensor_pose_uncertainties[i][0] * (M_PI/180));
 
-		for(std::map<int,std::map<int,std::vector<std::array<int,3>>>>::iterator it_sensor_i = mmv_plane_corresp.begin();
-		    it_sensor_i != mmv_plane_corresp.end(); it_sensor_i++)
+		if(params->match.hull_overlap_filter)
 		{
-			size_t sensor_i = it_sensor_i->first;
-			for(std::map<int,std::vector<std::array<int,3>>>::iterator it_sensor_j = it_sensor_i->second.begin();
-			    it_sensor_j != it_sensor_i->second.end(); it_sensor_j++)
+			hulls[i].resize(plane_count);
+			boxes[i].resize(plane_count);
+			for(size_t k = 0; k < plane_count; ++k)
 			{
-				size_t sensor_j = it_sensor_j->first;
-				int pos_sensor_i = 3 * (sensor_i - 1);
-				int pos_sensor_j = 3 * (sensor_j - 1);
+				const pcl::PointCloud<pcl::PointXYZRGBA> &hull = *(*planes[i])[k].getConvexHull();
+				hulls[i][k].resize(3, hull.points.size());
+				for(size_t v = 0; v < hull.points.size(); ++v)
+					hulls[i][k].col(v) = sensor_poses[i].block<3,3>(0,0) * hull.points[v].getVector3fMap() + sensor_poses[i].block<3,1>(0,3);
+
+				boxes[i][k].setEmpty();
+				for(int v = 0; v < hulls[i][k].cols(); ++v)
+					boxes[i][k].extend(hulls[i][k].col(v));
+			}
+		}
+	}
 
-				std::vector<std::array<int,3>> &correspondences = it_sensor_j->second;
-				for(int i = 0; i < correspondences.size(); i++)
-				{
-					size_t set_id = correspondences[i][0];
+	size_t mismatches = 0;
+	std::vector<int> candidates;
 
-					int sync_obs1_id = sync_model->findSyncIndexFromSet(set_id, sync_model->getSensorLabels()[sensor_i]);
-					int sync_obs2_id = sync_model->findSyncIndexFromSet(set_id, sync_model->getSensorLabels()[sensor_j]);
+	for(int i = 0; i < static_cast<int>(planes.size()) - 1; ++i)
+		for(int j = i+1; j < planes.size(); ++j)
+		{
+			const int rows = normals[i].cols(), cols = normals[j].cols();
+			if(rows == 0 || cols == 0 || (params->match.prune_sensor_pairs && !sensorsOverlap(i, j)))
+				continue;
+
+			const Scalar cos_threshold = cos(sensor_pose_uncertainties[j][0] * (M_PI/180));
+			// Parallel planes pass the gates even when they are far apart within the common plane, so the hulls must overlap as well.
+			// The cheap bounding box test rejects most of the disjoint pairs before the polygons are compared.
+			auto overlaps = [&](const int &ii, const int &jj)
+			{
+				if(!params->match.hull_overlap_filter)
+					return true;
 
-					Eigen::Vector3f n_obs_i = mvv_planes[sensor_i][sync_obs1_id][correspondences[i][1]].v3normal;
-					Eigen::Vector3f n_obs_j = mvv_planes[sensor_j][sync_obs2_id][correspondences[i][2]].v3normal;
+				Eigen::AlignedBox<Scalar,3> box = boxes[i][ii];
+				box.min().array() -= margin;
+				box.max().array() += margin;
+				if(!box.intersects(boxes[j][jj]))
+					return false;
 
-					Eigen::Vector3f n_i = sensor_poses[sensor_i].block(0,0,3,3) * n_obs_i;
-					Eigen::Vector3f n_j = sensor_poses[sensor_j].block(0,0,3,3) * n_obs_j;
+				return utils::convexPolygonsOverlap<Scalar>(hulls[i][ii], hulls[j][jj], (normals[i].col(ii) + normals[j].col(jj)).normalized(), margin);
+			};
 
-					jacobian_rot_i = -skew(n_i);
-					jacobian_rot_j = skew(n_j);
+			auto isSimilar = [&](const int &ii, const int &jj)
+			{
+				return !params->match.use_descriptors
+				        || (*planes[i])[ii].descriptor.isSimilar((*planes[j])[jj].descriptor, params->match.descriptor_tolerance);
+			};
 
-					Eigen::Vector3f rot_error = (n_i - n_j);
-					error += rot_error.dot(rot_error);
-					av_angle_error += acos(n_i.dot(n_j));
+			auto isMatch = [&](const int &ii, const int &jj)
+			{
+				return (normals[i].col(ii).dot(normals[j].col(jj)) > cos_threshold)
+				        && (std::abs(dists[i](ii) - dists[j](jj)) < sensor_pose_uncertainties[j][1]) && isSimilar(ii, jj) && overlaps(ii, jj);
+			};
 
-					if(sensor_i != 0) // The pose of the first camera is fixed
-					{
-						hessian.block(pos_sensor_i, pos_sensor_i, 3, 3) += jacobian_rot_i.transpose() * jacobian_rot_i;
-						gradient.block(pos_sensor_i,0,3,1) += jacobian_rot_i.transpose() * rot_error;
+			std::vector<std::array<int,3>> &pair_corresp = corresp[i][j];
+			const size_t first_match = pair_corresp.size();
 
-						// Cross term
-						hessian.block(pos_sensor_i, pos_sensor_j, 3, 3) += jacobian_rot_i.transpose() * jacobian_rot_j;
-					}
+			if(params->match.use_normal_index)
+			{
+				// Only the planes whose normals fall in the uncertainty cone are tested
+				for(int ii = 0; ii < rows; ++ii)
+				{
+					normal_indices[j].query(normals[i].col(ii), candidates);
+					for(const int &jj : candidates)
+						if(isMatch(ii, jj))
+							pair_corresp.push_back(std::array<int,3>{set_id, ii, jj});
+				}
 
-					hessian.block(pos_sensor_j, pos_sensor_j, 3, 3) += jacobian_rot_j.transpose() * jacobian_rot_j;
-					gradient.block(pos_sensor_j,0,3,1) += jacobian_rot_j.transpose() * rot_error;
+				if(params->match.verify_normal_index)
+				{
+					std::vector<std::array<int,3>> brute_force;
+					for(int ii = 0; ii < rows; ++ii)
+						for(int jj = 0; jj < cols; ++jj)
+							if(isMatch(ii, jj))
+								brute_force.push_back(std::array<int,3>{set_id, ii, jj});
+
+					if(!std::equal(brute_force.begin(), brute_force.end(), pair_corresp.begin() + first_match, pair_corresp.end()))
+						mismatches++;
 				}
+			}
 
-				if(sensor_i != 0) // Fill the lower left triangle with the corresponding cross terms
-					hessian.block(pos_sensor_j, pos_sensor_i, 3, 3) = hessian.block(pos_sensor_i, pos_sensor_j, 3, 3).transpose();
+			else
+			{
+				// Evaluate the angle and distance gates for all the plane pairs at once
+				Eigen::Array<bool,Eigen::Dynamic,Eigen::Dynamic> gate = ((normals[i].transpose() * normals[j]).array() > cos_threshold)
+				        && ((dists[i].transpose().replicate(1, cols) - dists[j].replicate(rows, 1)).array().abs() < sensor_pose_uncertainties[j][1]);
+
+				for(int ii = 0; ii < rows; ++ii)
+					for(int jj = 0; jj < cols; ++jj)
+						if(gate(ii,jj) && isSimilar(ii, jj) && overlaps(ii, jj))
+							pair_corresp.push_back(std::array<int,3>{set_id, ii, jj});
+			}
+
+			if(pair_matches)
+			{
+				TSetPairMatches &matches = (*pair_matches)[std::make_pair(i, j)];
+				matches.corresp.assign(pair_corresp.begin() + first_match, pair_corresp.end());
+				matches.pose_i = sensor_poses[i];
+				matches.pose_j = sensor_poses[j];
+				matches.uncertainty_j = sensor_pose_uncertainties[j];
+
+				// The hulls move with the poses in a way the slack does not bound, so any edit re-matches the set
+				if(params->match.hull_overlap_filter)
+					matches.angle_slack = matches.dist_slack = 0;
+				else
+				{
+					const Scalar angle_threshold = sensor_pose_uncertainties[j][0] * (M_PI/180), dist_threshold = sensor_pose_uncertainties[j][1];
+					const Eigen::Array<Scalar,Eigen::Dynamic,Eigen::Dynamic> angles = (normals[i].transpose() * normals[j]).array().max(Scalar(-1)).min(Scalar(1)).acos();
+					const Eigen::Array<Scalar,Eigen::Dynamic,Eigen::Dynamic> dist_diffs = (dists[i].transpose().replicate(1, cols) - dists[j].replicate(rows, 1)).array().abs();
+					const Eigen::Array<bool,Eigen::Dynamic,Eigen::Dynamic> angle_pass = angles < angle_threshold, dist_pass = dist_diffs < dist_threshold;
+
+					// A pair that fails the angle gate keeps failing while its angle stays beyond the threshold, whatever its distance,
+					// and a pair that passes it keeps its decision while neither value crosses its threshold
+					const Scalar inf = std::numeric_limits<Scalar>::infinity();
+					matches.angle_slack = (angle_pass && !dist_pass).select(inf, (angles - angle_threshold).abs()).minCoeff();
+					matches.dist_slack = angle_pass.select((dist_diffs - dist_threshold).abs(), inf).minCoeff();
+				}
 			}
 		}
 
-		//cout << "hessian \n" << hessian << endl;
-		//cout << "gradient \n" << gradient.transpose() << endl;
-		//cout << "Error accumulated " << accum_error2 << endl;
-		
-		Eigen::FullPivLU<Eigen::Matrix<Scalar, Eigen::Dynamic, Eigen::Dynamic>> lu(hessian);
-		if(!lu.isInvertible())
+	return mismatches;
+}
+
+size_t CCalibFromPlanes::rematchSensorPairs(const int &sensor_id)
+{
+	const std::vector<Eigen::Matrix4f> sensor_poses = sync_model->getSensorPoses();
+	const std::vector<Eigen::Vector2f> sensor_pose_uncertainties = sync_model->getSensorUncertainties();
+	const std::vector<std::string> sensor_labels = sync_model->getSensorLabels();
+
+	// The rotation angle between two poses, through the chord ||R1 - R2|| = 2 sqrt(2) sin(angle/2), which is exact for small angles
+	auto rotationChange = [](const Eigen::Matrix4f &pose1, const Eigen::Matrix4f &pose2)
+	{ return Scalar(2) * std::asin(std::min(Scalar(1), (pose1.block<3,3>(0,0) - pose2.block<3,3>(0,0)).norm() / Scalar(2 * M_SQRT2))); };
+
+	std::vector<std::tuple<int,int,int>> stale;
+	size_t dropped = 0;
+
+	// The edit moves the frustum of the sensor, so its pairs may enter or leave the prune
+	if(params->match.prune_sensor_pairs && !mv_sensor_cameras.empty())
+	{
+		computeSensorOverlap(mv_sensor_cameras, mv_sensor_max_ranges);
+
+		for(int k = 0; k < static_cast<int>(sensor_poses.size()); k++)
 		{
-			result.msg = "System is badly conditioned. Please try again with a new set of observations.";
-			break;
+			if(k == sensor_id)
+				continue;
+
+			const std::pair<int,int> sensor_pair = std::make_pair(std::min(k, sensor_id), std::max(k, sensor_id));
+			auto it_pair = m_pair_matches.find(sensor_pair);
+
+			if(!sensorsOverlap(sensor_pair.first, sensor_pair.second))
+			{
+				if(it_pair != m_pair_matches.end())
+				{
+					dropped += it_pair->second.size();
+					m_pair_matches.erase(it_pair);
+					mmv_plane_corresp[sensor_pair.first].erase(sensor_pair.second);
+				}
+				continue;
+			}
+
+			if(it_pair != m_pair_matches.end())
+				continue;
+
+			// The pair was pruned when the planes were matched, so it gets a full match in every set where both sensors have planes
+			for(const int &set_id : mv_matched_sets)
+			{
+				const int sync_obs1_id = sync_model->findSyncIndexFromSet(set_id, sensor_labels[sensor_pair.first]);
+				const int sync_obs2_id = sync_model->findSyncIndexFromSet(set_id, sensor_labels[sensor_pair.second]);
+				if(sync_obs1_id < 0 || sync_obs2_id < 0 || mvv_planes[sensor_pair.first][sync_obs1_id].empty() || mvv_planes[sensor_pair.second][sync_obs2_id].empty())
+					continue;
+
+				m_pair_matches[sensor_pair][set_id] = TSetPairMatches();
+				stale.push_back(std::make_tuple(sensor_pair.first, sensor_pair.second, set_id));
+			}
 		}
+	}
 
-		// Update rotation
-		update_vector = -hessian.inverse() * gradient;
-		//cout << "update_vector " << update_vector.transpose() << endl;
+	// A rotation by angle moves a normal by at most that angle, and a distance d - t.(R n) by at most |dt| + |t| angle
+	const size_t new_matches = stale.size();
+	for(auto it_pair = m_pair_matches.begin(); it_pair != m_pair_matches.end(); it_pair++)
+	{
+		const int sensor_i = it_pair->first.first, sensor_j = it_pair->first.second;
+		if(sensor_i != sensor_id && sensor_j != sensor_id)
+			continue;
 
-		for(int sensor_id = 1; sensor_id < num_sensors; sensor_id++)
+		// The pairs that newly passed the prune are already queued for all their sets
+		if(std::find_if(stale.begin(), stale.begin() + new_matches, [&](const std::tuple<int,int,int> &entry)
+		                { return std::get<0>(entry) == sensor_i && std::get<1>(entry) == sensor_j; }) != stale.begin() + new_matches)
+			continue;
+
+		for(auto it_set = it_pair->second.begin(); it_set != it_pair->second.end(); it_set++)
 		{
-			mrpt::poses::CPose3D pose;
-			mrpt::math::CArrayNumeric<double,3> rot_manifold;
-			rot_manifold[0] = update_vector(3*sensor_id-3,0);
-			rot_manifold[1] = update_vector(3*sensor_id-2,0);
-			rot_manifold[2] = update_vector(3*sensor_id-1,0);
-			mrpt::math::CMatrixDouble33 update_rot = pose.exp_rotation(rot_manifold);
-			//cout << "update_rot\n" << update_rot << endl;
-			Eigen::Matrix3f update_rot_eig;
-			update_rot_eig << update_rot(0,0), update_rot(0,1), update_rot(0,2),
-			        update_rot(1,0), update_rot(1,1), update_rot(1,2),
-			        update_rot(2,0), update_rot(2,1), update_rot(2,2);
-			estimated_poses_temp[sensor_id] = estimated_poses[sensor_id];
-			estimated_poses_temp[sensor_id].block(0,0,3,3) = update_rot_eig * estimated_poses[sensor_id].block(0,0,3,3);
-			//cout << "old rotation" << sensor_id << "\n" << Rt_estimated[sensor_id].block(0,0,3,3) << endl;
-			//cout << "new rotation\n" << Rt_estimatedTemp[sensor_id].block(0,0,3,3) << endl;
+			const TSetPairMatches &matches = it_set->second;
+			const Scalar rot_i = rotationChange(matches.pose_i, sensor_poses[sensor_i]), rot_j = rotationChange(matches.pose_j, sensor_poses[sensor_j]);
+			const Scalar angle_change = rot_i + rot_j + std::abs(sensor_pose_uncertainties[sensor_j][0] - matches.uncertainty_j[0]) * (M_PI/180);
+			const Scalar dist_change = (sensor_poses[sensor_i].block<3,1>(0,3) - matches.pose_i.block<3,1>(0,3)).norm() + matches.pose_i.block<3,1>(0,3).norm() * rot_i
+			        + (sensor_poses[sensor_j].block<3,1>(0,3) - matches.pose_j.block<3,1>(0,3)).norm() + matches.pose_j.block<3,1>(0,3).norm() * rot_j
+			        + std::abs(sensor_pose_uncertainties[sensor_j][1] - matches.uncertainty_j[1]);
+
+			if((angle_change == 0 && dist_change == 0) || (angle_change < matches.angle_slack && dist_change < matches.dist_slack))
+				continue;
+
+			stale.push_back(std::make_tuple(sensor_i, sensor_j, it_set->first));
 		}
+	}
 
-        //accum_error = computeRotationResidual(estimated_poses);
-		//cout << "Error accumulated " << accum_error2 << endl;
-		new_error = computeRotationResidual();
+	// Each stale set is matched for its sensor pair alone, and writes only to its own entry of m_pair_matches
+	std::atomic<size_t> next_set(0);
+	auto rematchSets = [&]()
+	{
+		for(size_t k = next_set++; k < stale.size(); k = next_set++)
+		{
+			int sensor_i, sensor_j, set_id;
+			std::tie(sensor_i, sensor_j, set_id) = stale[k];
 
-		//cout << "New rotation error " << new_accum_error2 << endl;
-		//cout << "Closing loop? \n" << Rt_estimated[0].inverse() * Rt_estimated[7] * Rt_78;
+			std::vector<const std::vector<CPlaneCHull>*> planes(sensor_poses.size(), nullptr);
+			planes[sensor_i] = &mvv_planes.at(sensor_i).at(sync_model->findSyncIndexFromSet(set_id, sensor_labels[sensor_i]));
+			planes[sensor_j] = &mvv_planes.at(sensor_j).at(sync_model->findSyncIndexFromSet(set_id, sensor_labels[sensor_j]));
 
-		//Assign new rotations
-		if(new_error < error)
-			for(int sensor_id = 1; sensor_id < num_sensors; sensor_id++)
-				estimated_poses[sensor_id] = estimated_poses_temp[sensor_id];
+			std::map<int,std::map<int,std::vector<std::array<int,3>>>> corresp;
+			std::map<std::pair<int,int>,TSetPairMatches> pair_matches;
+			findPotentialMatches(planes, set_id, corresp, &pair_matches);
+			m_pair_matches.at(std::make_pair(sensor_i, sensor_j)).at(set_id) = pair_matches.at(std::make_pair(sensor_i, sensor_j));
+		}
+	};
 
-		increment = update_vector.dot(update_vector);
-		diff_error = error - new_error;
-		++it;
-		//cout << "Iteration " << it << " increment " << increment << " diff_error " << diff_error << endl;
+	size_t thread_count = std::min<size_t>(std::max(1u, std::thread::hardware_concurrency()), stale.size());
+	std::vector<std::thread> threads;
+	for(size_t t = 0; t < thread_count; t++)
+		threads.emplace_back(rematchSets);
+	for(std::thread &thread : threads)
+		thread.join();
+
+	// The matches of the sensor's pairs are laid out again in set order
+	for(auto it_pair = m_pair_matches.begin(); it_pair != m_pair_matches.end(); it_pair++)
+	{
+		if(it_pair->first.first != sensor_id && it_pair->first.second != sensor_id)
+			continue;
+
+		std::vector<std::array<int,3>> &pair_corresp = mmv_plane_corresp[it_pair->first.first][it_pair->first.second];
+		pair_corresp.clear();
+		for(auto it_set = it_pair->second.begin(); it_set != it_pair->second.end(); it_set++)
+			pair_corresp.insert(pair_corresp.end(), it_set->second.corresp.begin(), it_set->second.corresp.end());
 	}
 
-	if(it == params->solver.max_iters)
-		result.msg = "Maximum iterations reached.";
-	else if(increment < params->solver.min_update)
-		result.msg = "Increment too small.";
-	else if(diff_error < params->solver.converge_error)
-		result.msg = "Convergence";
+	return stale.size() + dropped;
+}
 
-	result.init_error = init_error;
-	result.num_iters = it;
-	result.final_error = new_error;
-	result.estimate = estimated_poses;
+void CCalibFromPlanes::buildCorrespTable()
+{
+	buildCorrespTable(mmv_plane_corresp, m_plane_corresp);
+}
+
+void CCalibFromPlanes::buildCorrespTable(const std::map<int,std::map<int,std::vector<std::array<int,3>>>> &corresp, TPlaneCorrespTable &table) const
+{
+	const std::vector<std::string> sensor_labels = sync_model->getSensorLabels();
+	table.clear();
+
+	for(auto it_sensor_i = corresp.begin(); it_sensor_i != corresp.end(); it_sensor_i++)
+		for(auto it_sensor_j = it_sensor_i->second.begin(); it_sensor_j != it_sensor_i->second.end(); it_sensor_j++)
+		{
+			int sensor_i = it_sensor_i->first, sensor_j = it_sensor_j->first;
+			int set_id = -1, sync_obs1_id = -1, sync_obs2_id = -1;
 
-	//std::cout << "ErrorCalibRotation " << accum_error2/numPlaneCorresp << " " << av_angle_error/numPlaneCorresp << std::endl;
+			for(const std::array<int,3> &correspondence : it_sensor_j->second)
+			{
+				if(correspondence[0] != set_id)
+				{
+					set_id = correspondence[0];
+					sync_obs1_id = sync_model->findSyncIndexFromSet(set_id, sensor_labels[sensor_i]);
+					sync_obs2_id = sync_model->findSyncIndexFromSet(set_id, sensor_labels[sensor_j]);
+				}
+
+				const CPlaneCHull &plane_i = mvv_planes.at(sensor_i)[sync_obs1_id][correspondence[1]];
+				const CPlaneCHull &plane_j = mvv_planes.at(sensor_j)[sync_obs2_id][correspondence[2]];
+
+				TPlaneCorresp row;
+				row.set_id = set_id;
+				row.sensor_i = sensor_i;
+				row.sensor_j = sensor_j;
+				row.obs_i = sync_obs1_id;
+				row.obs_j = sync_obs2_id;
+				row.plane_i = correspondence[1];
+				row.plane_j = correspondence[2];
+				row.n_i = plane_i.v3normal;
+				row.n_j = plane_j.v3normal;
+				row.d_i = plane_i.d;
+				row.d_j = plane_j.d;
+				row.weight = 1;
+				table.rows.push_back(row);
+			}
+		}
+
+	// The maps already visit the sensor pairs in order; a stable sort groups the sets within each pair
+	std::stable_sort(table.rows.begin(), table.rows.end(), [](const TPlaneCorresp &a, const TPlaneCorresp &b)
+	{ return std::tie(a.sensor_i, a.sensor_j, a.set_id) < std::tie(b.sensor_i, b.sensor_j, b.set_id); });
+	table.index();
 }
 
-Scalar CCalibFromPlanes::computeTranslation()
+void CCalibFromPlanes::filterCorrespondences()
 {
-	std::vector<Eigen::Matrix4f> sensor_poses = sync_model->getSensorPoses();
-    const int num_sensors = sensor_poses.size();
-    const int dof = 3 * (num_sensors - 1);
-    Eigen::VectorXf update_vector(dof);
-    Eigen::Matrix3f jacobian_trans_i, jacobian_trans_j; // Jacobians of the rotation
-    float accum_error2(0.f);
-
-    for(std::map<int,std::map<int,std::vector<std::array<int,3>>>>::iterator it_sensor_i = mmv_plane_corresp.begin();
-        it_sensor_i != mmv_plane_corresp.end(); it_sensor_i++)
-    {
-        size_t sensor_i = it_sensor_i->first;
-        for(std::map<int,std::vector<std::array<int,3>>>::iterator it_sensor_j = it_sensor_i->second.begin();
-            it_sensor_j != it_sensor_i->second.end(); it_sensor_j++)
-        {
-            size_t sensor_j = it_sensor_j->first;
-            int pos_sensor_i = 3 * (sensor_i - 1);
-            int pos_sensor_j = 3 * (sensor_j - 1);
-
-            std::vector<std::array<int,3>> &correspondences = it_sensor_j->second;
-            for(int i = 0; i < correspondences.size(); i++)
-            {
-                size_t set_id = correspondences[i][0];
-
-                int sync_obs1_id = sync_model->findSyncIndexFromSet(set_id, sync_model->getSensorLabels()[sensor_i]);
-                int sync_obs2_id = sync_model->findSyncIndexFromSet(set_id, sync_model->getSensorLabels()[sensor_j]);
-
-                Eigen::Vector3f n_obs_i = mvv_planes[sensor_i][sync_obs1_id][correspondences[i][1]].v3normal;
-                Eigen::Vector3f n_obs_j = mvv_planes[sensor_j][sync_obs2_id][correspondences[i][2]].v3normal;
-
-                Eigen::Vector3f n_i = sensor_poses[sensor_i].block(0,0,3,3) * n_obs_i;
-                Eigen::Vector3f n_j = sensor_poses[sensor_j].block(0,0,3,3) * n_obs_j;
-
-                float trans_error = mvv_planes[sensor_i][sync_obs1_id][correspondences[i][1]].d - mvv_planes[sensor_j][sync_obs2_id][correspondences[i][2]].d; // Consider all zero initial translations
-                //trans_error = (mvv_planes[sensor_i][sync_obs1_id][correspondences[i][1]].d - Eigen::Vector3fsensor_poses[sensor_i].block(0,3,3,1)).dot(n_i) - (mvv_planes[sensor_j][sync_obs2_id][correspondences[i][2]].d - Eigen::Vector3f(sensor_poses[sensor_j].block(0,3,3,1)).dot(n_j));
-                accum_error2 += trans_error * trans_error;
-
-                jacobian_trans_i = n_i * n_i.transpose();
-                jacobian_trans_j = -n_i * n_j.transpose();
-
-                if(sensor_i != 0) // The pose of the first camera is fixed
-                {
-                    hessian.block(pos_sensor_i, pos_sensor_i, 3, 3) += jacobian_trans_i.transpose() * jacobian_trans_i;
-                    gradient.block(pos_sensor_i,0,3,1) += jacobian_trans_i.transpose() * trans_error;
-
-                    // Cross term
-                    hessian.block(pos_sensor_i, pos_sensor_j, 3, 3) += jacobian_trans_i.transpose() * jacobian_trans_j;
-                }
-
-                hessian.block(pos_sensor_j, pos_sensor_j, 3, 3) += jacobian_trans_j.transpose() * jacobian_trans_j;
-                gradient.block(pos_sensor_j,0,3,1) += jacobian_trans_j.transpose() * trans_error;
-            }
-
-            if(sensor_i != 0) // Fill the lower left triangle with the corresponding cross terms
-                hessian.block(pos_sensor_j, pos_sensor_i, 3, 3) = hessian.block(pos_sensor_i, pos_sensor_j, 3, 3).transpose();
-        }
-    }
-
-    //cout << "hessian \n" << hessian << endl;
-    //cout << "gradient \n" << gradient.transpose() << endl;
-    //cout << "Error accumulated " << accum_error2 << endl;
-
-    Eigen::FullPivLU<Eigen::Matrix<Scalar, Eigen::Dynamic, Eigen::Dynamic>> lu(hessian);
-    if(!lu.isInvertible())
-    {
-		result.msg = "System is badly conditioned. Please try again with a new set of observations.";
-        return accum_error2;
-    }
+	const std::vector<Eigen::Matrix4f> sensor_poses = sync_model->getSensorPoses();
+	const std::vector<Eigen::Vector2f> sensor_pose_uncertainties = sync_model->getSensorUncertainties();
+	const Scalar cos_inlier = cos(params->match.ransac_angle_threshold * (M_PI/180));
+	const Scalar min_sample_sin = sin(params->match.ransac_min_sample_angle * (M_PI/180)); // the two normals of a sample must be at least this far apart
+	const std::vector<TPlaneCorresp> &rows = m_plane_corresp.rows;
+
+	const std::vector<std::pair<std::pair<int,int>,std::array<size_t,2>>> pair_ranges(m_plane_corresp.pair_ranges.begin(), m_plane_corresp.pair_ranges.end());
+	std::vector<char> keep(rows.size(), 1);
+
+	auto filterPair = [&](const int &sensor_i, const int &sensor_j, const size_t &begin, const size_t &end)
+	{
+		if(end - begin < 3)
+			return;
+
+		// The hypotheses rotate the normals of sensor j into the frame of sensor i
+		const Eigen::Matrix3f init_rot = sensor_poses[sensor_i].block<3,3>(0,0).transpose() * sensor_poses[sensor_j].block<3,3>(0,0);
+		const Scalar cos_prior = cos((sensor_pose_uncertainties[sensor_i][0] + sensor_pose_uncertainties[sensor_j][0]) * (M_PI/180));
+
+		auto isInlier = [&](const Eigen::Matrix3f &rot, const size_t &k)
+		{ return (rot * rows[k].n_j).dot(rows[k].n_i) > cos_inlier; };
+
+		std::mt19937 rng(sensor_i * sensor_poses.size() + sensor_j);
+		std::uniform_int_distribution<size_t> pick(begin, end - 1);
+
+		Eigen::Matrix3f best_rot;
+		size_t best_count = 0;
+		for(int it = 0; it < params->match.ransac_iters; it++)
+		{
+			size_t a = pick(rng), b = pick(rng);
+			if(rows[a].n_j.cross(rows[b].n_j).norm() < min_sample_sin)
+				continue;
+
+			Eigen::Matrix3f rot = kabsch<Scalar>(rows[a].n_i * rows[a].n_j.transpose() + rows[b].n_i * rows[b].n_j.transpose());
+			if(((init_rot.transpose() * rot).trace() - 1) / 2 < cos_prior)
+				continue;
+
+			size_t count = 0;
+			for(size_t k = begin; k < end; k++)
+				count += isInlier(rot, k);
+
+			if(count > best_count)
+			{
+				best_count = count;
+				best_rot = rot;
+			}
+		}
 
-    // Update the translation (Linear Least-Squares -> exact solution)
-    update_vector = -hessian.inverse() * gradient;
-    //cout << "update_vector " << update_vector.transpose() << endl;
+		// Without a well conditioned hypothesis (e.g. all the normals are parallel) nothing can be rejected
+		if(best_count == 0)
+			return;
 
-//    for(int sensor_id = 1; sensor_id < num_sensors; sensor_id++)
-//        sensor_poses[sensor_id].block(0,3,3,1) = update_vector.block(3*(sensor_id-1),0,3,1);
+		Eigen::Matrix3f correlation = Eigen::Matrix3f::Zero();
+		for(size_t k = begin; k < end; k++)
+			if(isInlier(best_rot, k))
+				correlation += rows[k].weight * rows[k].n_i * rows[k].n_j.transpose();
+		best_rot = kabsch<Scalar>(correlation);
+
+		for(size_t k = begin; k < end; k++)
+			keep[k] = isInlier(best_rot, k);
+	};
+
+	std::atomic<size_t> next_pair(0);
+	auto filterPairs = [&]()
+	{
+		for(size_t k = next_pair++; k < pair_ranges.size(); k = next_pair++)
+			filterPair(pair_ranges[k].first.first, pair_ranges[k].first.second, pair_ranges[k].second[0], pair_ranges[k].second[1]);
+	};
+
+	size_t thread_count = std::min<size_t>(std::max(1u, std::thread::hardware_concurrency()), pair_ranges.size());
+	std::vector<std::thread> threads;
+	for(size_t t = 0; t < thread_count; t++)
+		threads.emplace_back(filterPairs);
+	for(std::thread &thread : threads)
+		thread.join();
+
+	std::vector<TPlaneCorresp> inliers;
+	for(size_t k = 0; k < rows.size(); k++)
+		if(keep[k])
+			inliers.push_back(rows[k]);
+
+	m_plane_corresp.rows.swap(inliers);
+	m_plane_corresp.index();
+}
+
+void CCalibFromPlanes::clusterCorrespondences()
+{
+	const std::vector<std::string> sensor_labels = sync_model->getSensorLabels();
+	const std::vector<Eigen::Matrix4f> sensor_poses = sync_model->getSensorPoses();
+	const Scalar cos_track = cos(params->match.track_angle_threshold * (M_PI/180));
+	const Scalar cos_viewpoint = cos(params->match.viewpoint_angle_threshold * (M_PI/180));
+	const int max_registration_iters = 5;
+
+	// A plane of a set in the rig frame, through the initial calibration of its sensor
+	struct TRigPlane
+	{
+		int sensor_id, obs_id, plane_id;
+		Eigen::Matrix<Scalar,3,1> n;
+		Scalar d;
+	};
+
+	// A physical plane in the frame of the rig at the first set, with the weighted sums of its observations
+	struct TTrack
+	{
+		Eigen::Matrix<Scalar,3,1> n, sum_n;
+		Scalar d, sum_d, count;
+	};
+
+	// The planes of all the sensors of each set are brought to the rig frame, and the rig motion since the first set is registered
+	// against the tracks, starting from the motion of the previous set. Only then are the planes associated to the tracks, so that
+	// two planes join a track only when they coincide in a common frame. A plane that cannot be associated starts a new track, so a
+	// motion that cannot be registered only reduces the collapse, and never merges different planes.
+	std::map<std::array<int,3>,int> plane_tracks; // [sensor_id, obs_id, plane_id] -> track_id
+	std::vector<TTrack> tracks;
+	Eigen::Matrix<Scalar,3,3> rig_rot = Eigen::Matrix<Scalar,3,3>::Identity();
+	Eigen::Matrix<Scalar,3,1> rig_trans = Eigen::Matrix<Scalar,3,1>::Zero();
+
+	for(const auto &set_ranges : m_plane_corresp.set_ranges)
+	{
+		std::vector<TRigPlane> rig_planes;
+		for(int sensor_id = 0; sensor_id < sensor_labels.size(); sensor_id++)
+		{
+			int sync_obs_id = sync_model->findSyncIndexFromSet(set_ranges.first, sensor_labels[sensor_id]);
+			if(sync_obs_id < 0 || sync_obs_id >= mvv_planes[sensor_id].size())
+				continue;
+
+			const std::vector<CPlaneCHull> &planes = mvv_planes[sensor_id][sync_obs_id];
+			for(int plane_id = 0; plane_id < planes.size(); plane_id++)
+			{
+				TRigPlane rig_plane{sensor_id, sync_obs_id, plane_id};
+				rig_plane.n = sensor_poses[sensor_id].block<3,3>(0,0) * planes[plane_id].v3normal;
+				rig_plane.d = planes[plane_id].d - sensor_poses[sensor_id].block<3,1>(0,3).dot(rig_plane.n);
+				rig_planes.push_back(rig_plane);
+			}
+		}
+
+		// Each track takes at most one plane of each sensor per set, the closest in normal within the gates
+		std::vector<int> associations(rig_planes.size());
+		auto associate = [&]()
+		{
+			std::set<std::pair<int,int>> used; // [track_id, sensor_id]
+			for(size_t k = 0; k < rig_planes.size(); k++)
+			{
+				const Eigen::Matrix<Scalar,3,1> n = rig_rot * rig_planes[k].n;
+				const Scalar d = rig_planes[k].d - rig_trans.dot(n);
+
+				associations[k] = -1;
+				Scalar best_cos = cos_track;
+				for(int track_id = 0; track_id < tracks.size(); track_id++)
+				{
+					Scalar cos_angle = n.dot(tracks[track_id].n);
+					if(cos_angle > best_cos && std::abs(d - tracks[track_id].d) < params->match.track_dist_threshold
+					        && !used.count(std::make_pair(track_id, rig_planes[k].sensor_id)))
+					{
+						best_cos = cos_angle;
+						associations[k] = track_id;
+					}
+				}
+
+				if(associations[k] >= 0)
+					used.insert(std::make_pair(associations[k], rig_planes[k].sensor_id));
+			}
+		};
+
+		// The rotation is refined by Kabsch when the associated normals determine it, and the translation by least squares
+		// over the plane distances, d_track = d - t.(R n), drawn towards the previous translation along the unobserved directions
+		for(int it = 0; it < max_registration_iters && !tracks.empty(); it++)
+		{
+			associate();
+
+			Eigen::Matrix<Scalar,3,3> correlation = Eigen::Matrix<Scalar,3,3>::Zero();
+			for(size_t k = 0; k < rig_planes.size(); k++)
+				if(associations[k] >= 0)
+					correlation += tracks[associations[k]].n * rig_planes[k].n.transpose();
+
+			Eigen::JacobiSVD<Eigen::Matrix<Scalar,3,3>> svd(correlation);
+			if(svd.singularValues()(1) > 1e-3 * svd.singularValues()(0))
+				rig_rot = kabsch<Scalar>(correlation);
+
+			Eigen::Matrix<Scalar,3,3> hessian = Scalar(1e-3) * Eigen::Matrix<Scalar,3,3>::Identity();
+			Eigen::Matrix<Scalar,3,1> gradient = Scalar(1e-3) * rig_trans;
+			for(size_t k = 0; k < rig_planes.size(); k++)
+				if(associations[k] >= 0)
+				{
+					const Eigen::Matrix<Scalar,3,1> n = rig_rot * rig_planes[k].n;
+					hessian += n * n.transpose();
+					gradient += n * (rig_planes[k].d - tracks[associations[k]].d);
+				}
 
-    return accum_error2;
+			const Eigen::Matrix<Scalar,3,1> new_trans = hessian.ldlt().solve(gradient);
+			const bool converged = (new_trans - rig_trans).norm() < 1e-4;
+			rig_trans = new_trans;
+			if(converged)
+				break;
+		}
+
+		associate();
+		for(size_t k = 0; k < rig_planes.size(); k++)
+		{
+			const Eigen::Matrix<Scalar,3,1> n = rig_rot * rig_planes[k].n;
+			const Scalar d = rig_planes[k].d - rig_trans.dot(n);
+
+			if(associations[k] < 0)
+			{
+				associations[k] = tracks.size();
+				tracks.push_back(TTrack{n, Eigen::Matrix<Scalar,3,1>::Zero(), d, 0, 0});
+			}
+
+			TTrack &track = tracks[associations[k]];
+			track.sum_n += n;
+			track.sum_d += d;
+			track.count += 1;
+			track.n = track.sum_n.normalized();
+			track.d = track.sum_d / track.count;
+
+			plane_tracks[std::array<int,3>{rig_planes[k].sensor_id, rig_planes[k].obs_id, rig_planes[k].plane_id}] = associations[k];
+		}
+	}
+
+	// Collapse the correspondences between the same pair of tracks (and viewpoint) into their weighted mean
+	std::vector<TPlaneCorresp> clusters;
+	for(const auto &pair_range : m_plane_corresp.pair_ranges)
+	{
+		std::map<std::array<int,2>,std::vector<size_t>> track_pair_clusters; // [track_i, track_j] -> indices of the clusters
+		const size_t first_cluster = clusters.size();
+		std::vector<std::array<Eigen::Matrix<Scalar,3,1>,2>> first_normals; // the normals in the sensor frames that started each cluster
+
+		for(size_t k = pair_range.second[0]; k < pair_range.second[1]; k++)
+		{
+			const TPlaneCorresp &row = m_plane_corresp.rows[k];
+			std::array<int,2> track_pair{plane_tracks[std::array<int,3>{row.sensor_i, row.obs_i, row.plane_i}],
+				                         plane_tracks[std::array<int,3>{row.sensor_j, row.obs_j, row.plane_j}]};
+
+			// A correspondence only joins a cluster seen from the same viewpoint by both sensors, unless the viewpoints are merged
+			std::vector<size_t> &candidates = track_pair_clusters[track_pair];
+			size_t cluster = clusters.size();
+			for(const size_t &candidate : candidates)
+				if(!params->match.split_viewpoints || (first_normals[candidate - first_cluster][0].dot(row.n_i) > cos_viewpoint
+				                                       && first_normals[candidate - first_cluster][1].dot(row.n_j) > cos_viewpoint))
+				{
+					cluster = candidate;
+					break;
+				}
+
+			if(cluster == clusters.size())
+			{
+				candidates.push_back(cluster);
+				first_normals.push_back(std::array<Eigen::Matrix<Scalar,3,1>,2>{row.n_i, row.n_j});
+				clusters.push_back(row);
+				TPlaneCorresp &sum = clusters.back();
+				sum.n_i.setZero();
+				sum.n_j.setZero();
+				sum.d_i = sum.d_j = sum.weight = 0;
+			}
+
+			TPlaneCorresp &sum = clusters[cluster];
+			sum.n_i += row.weight * row.n_i;
+			sum.n_j += row.weight * row.n_j;
+			sum.d_i += row.weight * row.d_i;
+			sum.d_j += row.weight * row.d_j;
+			sum.weight += row.weight;
+		}
+
+		for(size_t cluster = first_cluster; cluster < clusters.size(); cluster++)
+		{
+			clusters[cluster].n_i.normalize();
+			clusters[cluster].n_j.normalize();
+			clusters[cluster].d_i /= clusters[cluster].weight;
+			clusters[cluster].d_j /= clusters[cluster].weight;
+		}
+	}
+
+	// Each cluster keeps the set, observation and plane ids of its first correspondence, so the table stays sorted by pair and set
+	std::stable_sort(clusters.begin(), clusters.end(), [](const TPlaneCorresp &a, const TPlaneCorresp &b)
+	{ return std::tie(a.sensor_i, a.sensor_j, a.set_id) < std::tie(b.sensor_i, b.sensor_j, b.set_id); });
+	m_plane_corresp.rows.swap(clusters);
+	m_plane_corresp.index();
+}
+
+Scalar CCalibFromPlanes::computeRotationResidual()
+{
+	return computeRotationResidual(sync_model->getSensorPoses(), m_plane_corresp);
+}
+
+template<typename C, typename T>
+T CCalibFromPlanes::computeRotationResidual(const std::vector<Eigen::Matrix<T,4,4>> &sensor_poses, const TPlaneCorrespTable &corresp) const
+{
+	T sum_squared_error = 0.; // Accumulated squared error for all plane correspondences
+
+	for(const TPlaneCorresp &row : corresp.rows)
+	{
+		Eigen::Matrix<C,3,1> n_i = sensor_poses[row.sensor_i].template block<3,3>(0,0).template cast<C>() * row.n_i.cast<C>();
+		Eigen::Matrix<C,3,1> n_j = sensor_poses[row.sensor_j].template block<3,3>(0,0).template cast<C>() * row.n_j.cast<C>();
+
+		Eigen::Matrix<C,3,1> rot_error = (n_i - n_j);
+		sum_squared_error += C(row.weight) * rot_error.dot(rot_error);
+	}
+
+	return sum_squared_error;
+}
+
+void CCalibFromPlanes::computeRotationStats(const TPlaneCorrespTable &corresp, std::vector<TPairRotationStats> &pair_stats) const
+{
+	pair_stats.clear();
+	for(const auto &pair_range : corresp.pair_ranges)
+	{
+		TPairRotationStats stats;
+		stats.sensor_i = pair_range.first.first;
+		stats.sensor_j = pair_range.first.second;
+		stats.correlation.setZero();
+		stats.scatter_i.setZero();
+		stats.scatter_j.setZero();
+
+		for(size_t k = pair_range.second[0]; k < pair_range.second[1]; k++)
+		{
+			const TPlaneCorresp &row = corresp.rows[k];
+			const Eigen::Vector3d n_i = row.n_i.cast<double>(), n_j = row.n_j.cast<double>();
+			stats.correlation += row.weight * n_i * n_j.transpose();
+			stats.scatter_i += row.weight * n_i * n_i.transpose();
+			stats.scatter_j += row.weight * n_j * n_j.transpose();
+		}
+
+		pair_stats.push_back(stats);
+	}
+}
+
+template<typename T>
+double CCalibFromPlanes::computeRotationResidual(const std::vector<Eigen::Matrix<T,4,4>> &sensor_poses, const std::vector<TPairRotationStats> &pair_stats) const
+{
+	// sum w |R_i n_i - R_j n_j|^2 = tr(S_i) + tr(S_j) - 2 tr(R_j M^T R_i^T)
+	double sum_squared_error = 0.;
+	for(const TPairRotationStats &stats : pair_stats)
+	{
+		const Eigen::Matrix3d rot_i = sensor_poses[stats.sensor_i].template block<3,3>(0,0).template cast<double>();
+		const Eigen::Matrix3d rot_j = sensor_poses[stats.sensor_j].template block<3,3>(0,0).template cast<double>();
+		sum_squared_error += stats.scatter_i.trace() + stats.scatter_j.trace() - 2 * (rot_j * stats.correlation.transpose() * rot_i.transpose()).trace();
+	}
+
+	return std::max(0., sum_squared_error);
+}
+
+template<typename T>
+void CCalibFromPlanes::computeRotationInit(const std::vector<TPairRotationStats> &pair_stats, std::vector<Eigen::Matrix<T,4,4>> &sensor_poses) const
+{
+	// The Kabsch rotation of each pair, R_i^T R_j, and how well it is determined: a pair whose normals span a single direction
+	// leaves the rotation about it free, so its strength is the second singular value of the correlation
+	std::vector<Eigen::Matrix3d> pair_rotations(pair_stats.size());
+	std::vector<double> strengths(pair_stats.size());
+	for(size_t k = 0; k < pair_stats.size(); k++)
+	{
+		Eigen::JacobiSVD<Eigen::Matrix3d> svd(pair_stats[k].correlation);
+		strengths[k] = (svd.singularValues()(1) > 1e-3 * svd.singularValues()(0)) ? svd.singularValues()(1) : 0;
+		pair_rotations[k] = kabsch<double>(pair_stats[k].correlation);
+	}
+
+	// Grow a maximum spanning tree from the reference sensor (Prim), chaining the rotations along its edges
+	std::vector<bool> in_tree(sensor_poses.size(), false);
+	in_tree[0] = true;
+	while(true)
+	{
+		int best = -1;
+		for(size_t k = 0; k < pair_stats.size(); k++)
+			if(strengths[k] > 0 && in_tree[pair_stats[k].sensor_i] != in_tree[pair_stats[k].sensor_j] && (best < 0 || strengths[k] > strengths[best]))
+				best = k;
+
+		if(best < 0)
+			break;
+
+		const int sensor_i = pair_stats[best].sensor_i, sensor_j = pair_stats[best].sensor_j;
+		if(in_tree[sensor_i])
+			sensor_poses[sensor_j].template block<3,3>(0,0) = (sensor_poses[sensor_i].template block<3,3>(0,0).template cast<double>() * pair_rotations[best]).template cast<T>();
+		else
+			sensor_poses[sensor_i].template block<3,3>(0,0) = (sensor_poses[sensor_j].template block<3,3>(0,0).template cast<double>() * pair_rotations[best].transpose()).template cast<T>();
+
+		in_tree[sensor_i] = in_tree[sensor_j] = true;
+	}
+}
+
+Scalar CCalibFromPlanes::computeRotation()
+{
+	result = solveRotation(sync_model->getSensorPoses(), m_plane_corresp);
+	return result.final_error;
+}
+
+template<typename C, typename T>
+void CCalibFromPlanes::accumulateRotation(const std::vector<Eigen::Matrix<T,4,4>> &sensor_poses, const TPlaneCorrespTable &corresp, const size_t &begin, const size_t &end,
+                                          TPairSystem<T> &system) const
+{
+	Eigen::Matrix<C,3,3> jacobian_rot_i, jacobian_rot_j; // Jacobians of the rotation
+	system.setZero();
+
+	for(size_t k = begin; k < end; k++)
+	{
+		const TPlaneCorresp &row = corresp.rows[k];
+		const C weight = row.weight;
+
+		Eigen::Matrix<C,3,1> n_i = sensor_poses[row.sensor_i].template block<3,3>(0,0).template cast<C>() * row.n_i.cast<C>();
+		Eigen::Matrix<C,3,1> n_j = sensor_poses[row.sensor_j].template block<3,3>(0,0).template cast<C>() * row.n_j.cast<C>();
+
+		jacobian_rot_i = -skew(n_i);
+		jacobian_rot_j = skew(n_j);
+
+		Eigen::Matrix<C,3,1> rot_error = (n_i - n_j);
+		system.error += weight * rot_error.dot(rot_error);
+
+		system.h_ii += (weight * jacobian_rot_i.transpose() * jacobian_rot_i).template cast<T>();
+		system.h_jj += (weight * jacobian_rot_j.transpose() * jacobian_rot_j).template cast<T>();
+		system.h_ij += (weight * jacobian_rot_i.transpose() * jacobian_rot_j).template cast<T>();
+		system.g_i += (weight * jacobian_rot_i.transpose() * rot_error).template cast<T>();
+		system.g_j += (weight * jacobian_rot_j.transpose() * rot_error).template cast<T>();
+	}
+}
+
+template<typename T>
+void CCalibFromPlanes::accumulateRotation(const std::vector<Eigen::Matrix<T,4,4>> &sensor_poses, const TPairRotationStats &stats, TPairSystem<T> &system) const
+{
+	// With a = R_i n_i, b = R_j n_j and N = sum w b a^T = R_j M^T R_i^T, the sums of the per-correspondence terms are
+	// H_ii = tr(A) I - A with A = R_i S_i R_i^T (likewise H_jj), H_ij = N - tr(N) I, and g_j = -g_i = vex(N - N^T)
+	const Eigen::Matrix3d rot_i = sensor_poses[stats.sensor_i].template block<3,3>(0,0).template cast<double>();
+	const Eigen::Matrix3d rot_j = sensor_poses[stats.sensor_j].template block<3,3>(0,0).template cast<double>();
+
+	const Eigen::Matrix3d scatter_i = rot_i * stats.scatter_i * rot_i.transpose();
+	const Eigen::Matrix3d scatter_j = rot_j * stats.scatter_j * rot_j.transpose();
+	const Eigen::Matrix3d correlation = rot_j * stats.correlation.transpose() * rot_i.transpose();
+	const Eigen::Matrix3d antisym = correlation - correlation.transpose();
+	const Eigen::Matrix<T,3,1> cross_sum = Eigen::Vector3d(antisym(2,1), antisym(0,2), antisym(1,0)).cast<T>();
+
+	system.error = std::max(0., scatter_i.trace() + scatter_j.trace() - 2 * correlation.trace());
+	system.h_ii = (scatter_i.trace() * Eigen::Matrix3d::Identity() - scatter_i).cast<T>();
+	system.h_jj = (scatter_j.trace() * Eigen::Matrix3d::Identity() - scatter_j).cast<T>();
+	system.h_ij = (correlation - correlation.trace() * Eigen::Matrix3d::Identity()).cast<T>();
+	system.g_i = -cross_sum;
+	system.g_j = cross_sum;
+}
+
+template<class TChunks, class TAccumulate>
+void CCalibFromPlanes::accumulateChunks(TChunks &chunks, const TAccumulate &accumulate) const
+{
+	std::atomic<size_t> next_chunk(0);
+	auto accumulateNext = [&]()
+	{
+		for(size_t k = next_chunk++; k < chunks.ranges.size(); k = next_chunk++)
+			accumulate(chunks.ranges[k], chunks.systems[k]);
+	};
+
+	size_t thread_count = params->solver.parallel_accumulation ? std::min<size_t>(std::max(1u, std::thread::hardware_concurrency()), chunks.ranges.size()) : 1;
+	if(thread_count <= 1)
+	{
+		accumulateNext();
+		return;
+	}
+
+	std::vector<std::thread> threads;
+	for(size_t t = 0; t < thread_count; t++)
+		threads.emplace_back(accumulateNext);
+	for(std::thread &thread : threads)
+		thread.join();
+}
+
+/** The arithmetic precision of a solver, the precision of its sums being that of its normal equations, for dispatchSolver(). */
+template<typename C, class THessian>
+struct TSolverTypes
+{
+	typedef C Compute;
+	typedef THessian Hessian;
+};
+
+/** Calls solve(TSolverTypes) with fixed-size normal equations for the common small rigs of 2 to 4 sensors, and a CBlockHessian otherwise. */
+template<typename C, typename T, int B, class TSolve>
+static TSolverResult dispatchHessian(const size_t &num_sensors, const TSolve &solve)
+{
+	switch(num_sensors)
+	{
+	case 2:
+		return solve(TSolverTypes<C,CFixedHessian<T,2,B>>());
+	case 3:
+		return solve(TSolverTypes<C,CFixedHessian<T,3,B>>());
+	case 4:
+		return solve(TSolverTypes<C,CFixedHessian<T,4,B>>());
+	default:
+		return solve(TSolverTypes<C,CBlockHessian<T,B>>());
+	}
+}
+
+/** Calls solve(TSolverTypes) with the arithmetic of the given precision, and the normal equations with B parameters per sensor that suit the rig. */
+template<int B, class TSolve>
+static TSolverResult dispatchSolver(const SolverPrecision &precision, const size_t &num_sensors, const TSolve &solve)
+{
+	switch(precision)
+	{
+	case SOLVER_MIXED:
+		return dispatchHessian<float,double,B>(num_sensors, solve);
+	case SOLVER_DOUBLE:
+		return dispatchHessian<double,double,B>(num_sensors, solve);
+	default:
+		return dispatchHessian<float,float,B>(num_sensors, solve);
+	}
+}
+
+/** Converts poses to the precision T, in which the solvers iterate. */
+template<typename T, typename S>
+static std::vector<Eigen::Matrix<T,4,4>> castPoses(const std::vector<Eigen::Matrix<S,4,4>> &poses)
+{
+	std::vector<Eigen::Matrix<T,4,4>> cast_poses(poses.size());
+	for(size_t k = 0; k < poses.size(); k++)
+		cast_poses[k] = poses[k].template cast<T>();
+
+	return cast_poses;
+}
+
+template<typename C, class THessian>
+TSolverResult CCalibFromPlanes::solveRotationWith(const std::vector<Eigen::Matrix4f> &sensor_poses, const TPlaneCorrespTable &corresp) const
+{
+	typedef typename THessian::Scalar T;
+	const int num_sensors = sensor_poses.size();
+	typename THessian::Vector update_vector;
+	T error, new_error, init_error, conditioning = 0;
+	TSolverResult result;
+
+	// The poses are iterated in the precision of the normal equations, and only the estimate is returned in Scalar
+	std::vector<Eigen::Matrix<T,4,4>> estimated_poses = castPoses<T>(sensor_poses);
+	std::vector<Eigen::Matrix<T,4,4>> estimated_poses_temp = estimated_poses;
+
+	T increment = 1000, diff_error = 1000;
+	int it = 0;
+
+	// With sufficient_statistics the correspondences are reduced once to per-pair sums, which give the residual, gradient and Hessian exactly
+	const bool use_stats = params->solver.sufficient_statistics;
+	std::vector<TPairRotationStats> pair_stats;
+	if(use_stats || params->solver.closed_form_init)
+		computeRotationStats(corresp, pair_stats);
+
+	auto residual = [&](const std::vector<Eigen::Matrix<T,4,4>> &poses)
+	{ return use_stats ? T(computeRotationResidual(poses, pair_stats)) : computeRotationResidual<C,T>(poses, corresp); };
+
+	init_error = new_error = error = residual(estimated_poses);
+
+	// The closed form rotations replace the initial ones only when they fit the correspondences better
+	if(params->solver.closed_form_init)
+	{
+		std::vector<Eigen::Matrix<T,4,4>> closed_form_poses = estimated_poses;
+		computeRotationInit(pair_stats, closed_form_poses);
+
+		T closed_form_error = residual(closed_form_poses);
+		if(closed_form_error < init_error)
+		{
+			estimated_poses = estimated_poses_temp = closed_form_poses;
+			new_error = error = closed_form_error;
+		}
+	}
+
+	// The Hessian only has blocks for the observed sensor pairs, and its structure is set up once for all the iterations
+	std::vector<std::pair<std::pair<int,int>,std::array<size_t,2>>> pair_ranges(corresp.pair_ranges.begin(), corresp.pair_ranges.end());
+	std::vector<std::pair<int,int>> sensor_pairs;
+	for(const auto &pair_range : pair_ranges)
+		sensor_pairs.push_back(pair_range.first);
+
+	THessian hessian; // Hessian of the rotation of the decoupled system
+	hessian.init(num_sensors, sensor_pairs, params->solver.sparse_min_sensors);
+	TPairSystem<T> pair_system;
+
+	TPairChunks<T> chunks;
+	if(!use_stats)
+	{
+		std::vector<std::array<size_t,2>> ranges;
+		for(const auto &pair_range : pair_ranges)
+			ranges.push_back(pair_range.second);
+		chunks.init(ranges, std::max(1, params->solver.accumulation_chunk_size));
+	}
+
+	while(it < params->solver.max_iters && increment > params->solver.min_update && diff_error > params->solver.converge_error)
+	{
+		// Calculate the hessian and the gradient at the current estimate
+		hessian.setZero();
+		error = 0.0;
+
+		if(!use_stats)
+			accumulateChunks(chunks, [&](const std::array<size_t,2> &range, TPairSystem<T> &system)
+			{ accumulateRotation<C>(estimated_poses, corresp, range[0], range[1], system); });
+
+		for(size_t p = 0; p < pair_ranges.size(); p++)
+		{
+			if(use_stats)
+				accumulateRotation(estimated_poses, pair_stats[p], pair_system);
+			else
+				chunks.reduce(p, pair_system);
+
+			error += pair_system.error;
+			hessian.add(pair_ranges[p].first.first, pair_ranges[p].first.second, pair_system);
+		}
+
+		// Update rotation
+		if(!hessian.solve(update_vector, conditioning, eigenvalue_ratio_threshold))
+		{
+			result.msg = "System is badly conditioned. Please try again with a new set of observations.";
+			break;
+		}
+
+		for(int sensor_id = 1; sensor_id < num_sensors; sensor_id++)
+		{
+			mrpt::poses::CPose3D pose;
+			mrpt::math::CArrayNumeric<double,3> rot_manifold;
+			rot_manifold[0] = update_vector(3*sensor_id-3,0);
+			rot_manifold[1] = update_vector(3*sensor_id-2,0);
+			rot_manifold[2] = update_vector(3*sensor_id-1,0);
+			mrpt::math::CMatrixDouble33 update_rot = pose.exp_rotation(rot_manifold);
+			Eigen::Matrix<T,3,3> update_rot_eig;
+			update_rot_eig << update_rot(0,0), update_rot(0,1), update_rot(0,2),
+			        update_rot(1,0), update_rot(1,1), update_rot(1,2),
+			        update_rot(2,0), update_rot(2,1), update_rot(2,2);
+			estimated_poses_temp[sensor_id] = estimated_poses[sensor_id];
+			estimated_poses_temp[sensor_id].template block<3,3>(0,0) = update_rot_eig * estimated_poses[sensor_id].template block<3,3>(0,0);
+		}
+
+		new_error = residual(estimated_poses_temp);
+
+		//Assign new rotations
+		if(new_error < error)
+			for(int sensor_id = 1; sensor_id < num_sensors; sensor_id++)
+				estimated_poses[sensor_id] = estimated_poses_temp[sensor_id];
+
+		increment = update_vector.dot(update_vector);
+		diff_error = error - new_error;
+		++it;
+	}
+
+	if(it == params->solver.max_iters)
+		result.msg = "Maximum iterations reached.";
+	else if(increment < params->solver.min_update)
+		result.msg = "Increment too small.";
+	else if(diff_error < params->solver.converge_error)
+		result.msg = "Convergence";
+
+	result.init_error = init_error;
+	result.num_iters = it;
+	result.final_error = std::min(new_error, error);
+	result.conditioning = conditioning;
+	result.estimate = castPoses<Scalar>(estimated_poses);
+
+	return result;
+}
+
+TSolverResult CCalibFromPlanes::solveRotation(const std::vector<Eigen::Matrix4f> &sensor_poses, const TPlaneCorrespTable &corresp) const
+{
+	return dispatchSolver<3>(params->solver.precision, sensor_poses.size(), [&](auto types)
+	{ return solveRotationWith<typename decltype(types)::Compute, typename decltype(types)::Hessian>(sensor_poses, corresp); });
+}
+
+std::vector<TThresholdSweepPoint> CCalibFromPlanes::sweepThresholds(const std::vector<std::vector<const std::vector<CPlaneCHull>*>> &planes, const std::vector<int> &set_ids,
+                                                                    std::vector<Scalar> angle_thresholds, std::vector<Scalar> dist_thresholds)
+{
+	std::vector<TThresholdSweepPoint> sweep;
+	if(angle_thresholds.empty() || dist_thresholds.empty())
+		return sweep;
+
+	std::sort(angle_thresholds.begin(), angle_thresholds.end());
+	std::sort(dist_thresholds.begin(), dist_thresholds.end());
+
+	// A pair accepted at a tight threshold is accepted at all the looser ones, so the sets are matched once at the loosest point
+	const Eigen::Vector2f loosest(angle_thresholds.back(), dist_thresholds.back());
+	std::vector<std::map<int,std::map<int,std::vector<std::array<int,3>>>>> set_corresp(set_ids.size());
+	std::atomic<size_t> next_set(0);
+	auto matchSets = [&]()
+	{
+		for(size_t k = next_set++; k < set_ids.size(); k = next_set++)
+			findPotentialMatches(planes[k], set_ids[k], set_corresp[k], nullptr, &loosest);
+	};
+
+	size_t thread_count = std::min<size_t>(std::max(1u, std::thread::hardware_concurrency()), set_ids.size());
+	std::vector<std::thread> threads;
+	for(size_t t = 0; t < thread_count; t++)
+		threads.emplace_back(matchSets);
+	for(std::thread &thread : threads)
+		thread.join();
+
+	std::map<int,std::map<int,std::vector<std::array<int,3>>>> corresp;
+	for(size_t k = 0; k < set_ids.size(); k++)
+		for(auto iter1 = set_corresp[k].begin(); iter1 != set_corresp[k].end(); iter1++)
+			for(auto iter2 = iter1->second.begin(); iter2 != iter1->second.end(); iter2++)
+				corresp[iter1->first][iter2->first].insert(corresp[iter1->first][iter2->first].end(), iter2->second.begin(), iter2->second.end());
+
+	TPlaneCorrespTable loose_corresp;
+	buildCorrespTable(corresp, loose_corresp);
+
+	// The tightest thresholds of each grid axis that still accept each correspondence, with the same gates as findPotentialMatches()
+	const std::vector<Eigen::Matrix4f> sensor_poses = sync_model->getSensorPoses();
+	std::vector<std::array<size_t,2>> first_accepted(loose_corresp.rows.size());
+	for(size_t k = 0; k < loose_corresp.rows.size(); k++)
+	{
+		const TPlaneCorresp &row = loose_corresp.rows[k];
+		const Eigen::Vector3f n_i = sensor_poses[row.sensor_i].block<3,3>(0,0) * row.n_i;
+		const Eigen::Vector3f n_j = sensor_poses[row.sensor_j].block<3,3>(0,0) * row.n_j;
+		const Scalar cos_angle = n_i.dot(n_j);
+		const Scalar dist_diff = std::abs((row.d_i - sensor_poses[row.sensor_i].block<3,1>(0,3).dot(n_i)) - (row.d_j - sensor_poses[row.sensor_j].block<3,1>(0,3).dot(n_j)));
+
+		for(first_accepted[k][0] = 0; first_accepted[k][0] < angle_thresholds.size() && !(cos_angle > cos(angle_thresholds[first_accepted[k][0]] * (M_PI/180))); first_accepted[k][0]++);
+		for(first_accepted[k][1] = 0; first_accepted[k][1] < dist_thresholds.size() && !(dist_diff < dist_thresholds[first_accepted[k][1]]); first_accepted[k][1]++);
+	}
+
+	// Each grid point keeps the correspondences it accepts, in the order of the table, and is solved independently
+	sweep.resize(angle_thresholds.size() * dist_thresholds.size());
+	std::atomic<size_t> next_point(0);
+	auto solvePoints = [&]()
+	{
+		for(size_t p = next_point++; p < sweep.size(); p = next_point++)
+		{
+			const size_t a = p / dist_thresholds.size(), d = p % dist_thresholds.size();
+			TPlaneCorrespTable point_corresp;
+			for(size_t k = 0; k < loose_corresp.rows.size(); k++)
+				if(first_accepted[k][0] <= a && first_accepted[k][1] <= d)
+					point_corresp.rows.push_back(loose_corresp.rows[k]);
+			point_corresp.index();
+
+			sweep[p].angle_threshold = angle_thresholds[a];
+			sweep[p].dist_threshold = dist_thresholds[d];
+			sweep[p].num_corresp = point_corresp.rows.size();
+			sweep[p].num_pairs = point_corresp.pair_ranges.size();
+			sweep[p].result = solveRotation(sensor_poses, point_corresp);
+		}
+	};
+
+	// With parallel_accumulation each solve already spreads over all the cores, so the points are solved one after the other
+	thread_count = params->solver.parallel_accumulation ? 1 : std::min<size_t>(std::max(1u, std::thread::hardware_concurrency()), sweep.size());
+	if(thread_count <= 1)
+	{
+		solvePoints();
+		return sweep;
+	}
+
+	threads.clear();
+	for(size_t t = 0; t < thread_count; t++)
+		threads.emplace_back(solvePoints);
+	for(std::thread &thread : threads)
+		thread.join();
+
+	return sweep;
+}
+
+Scalar CCalibFromPlanes::computeTranslation()
+{
+	// Start from the rotations of the last rotation solver run, if any
+	std::vector<Eigen::Matrix4f> sensor_poses = sync_model->getSensorPoses();
+	if(result.estimate.size() == sensor_poses.size())
+		sensor_poses = result.estimate;
+
+	TSolverResult translation_result = solveTranslation(sensor_poses, m_plane_corresp);
+	result.estimate = translation_result.estimate;
+	if(translation_result.num_iters == 0)
+		result.msg = translation_result.msg;
+
+	return translation_result.final_error;
+}
+
+template<typename C, typename T>
+T CCalibFromPlanes::computeTranslationResidual(const std::vector<Eigen::Matrix<T,4,4>> &sensor_poses, const TPlaneCorrespTable &corresp) const
+{
+	T sum_squared_error = 0.;
+
+	for(const TPlaneCorresp &row : corresp.rows)
+	{
+		Eigen::Matrix<C,3,1> n_i = sensor_poses[row.sensor_i].template block<3,3>(0,0).template cast<C>() * row.n_i.cast<C>();
+		Eigen::Matrix<C,3,1> n_j = sensor_poses[row.sensor_j].template block<3,3>(0,0).template cast<C>() * row.n_j.cast<C>();
+
+		C trans_error = (C(row.d_i) - sensor_poses[row.sensor_i].template block<3,1>(0,3).template cast<C>().dot(n_i)) - (C(row.d_j) - sensor_poses[row.sensor_j].template block<3,1>(0,3).template cast<C>().dot(n_j));
+		sum_squared_error += C(row.weight) * trans_error * trans_error;
+	}
+
+	return sum_squared_error;
+}
+
+template<typename C, typename T>
+void CCalibFromPlanes::accumulateTranslation(const std::vector<Eigen::Matrix<T,4,4>> &sensor_poses, const TPlaneCorrespTable &corresp, const size_t &begin, const size_t &end,
+                                             TPairSystem<T> &system) const
+{
+	Eigen::Matrix<C,1,3> jacobian_trans_i, jacobian_trans_j; // Jacobians of the translation
+	system.setZero();
+
+	// The plane distances in the common frame, d - t.(R n), are linear in the translations for fixed rotations
+	for(size_t k = begin; k < end; k++)
+	{
+		const TPlaneCorresp &row = corresp.rows[k];
+		const C weight = row.weight;
+
+		Eigen::Matrix<C,3,1> n_i = sensor_poses[row.sensor_i].template block<3,3>(0,0).template cast<C>() * row.n_i.cast<C>();
+		Eigen::Matrix<C,3,1> n_j = sensor_poses[row.sensor_j].template block<3,3>(0,0).template cast<C>() * row.n_j.cast<C>();
+
+		C trans_error = (C(row.d_i) - sensor_poses[row.sensor_i].template block<3,1>(0,3).template cast<C>().dot(n_i)) - (C(row.d_j) - sensor_poses[row.sensor_j].template block<3,1>(0,3).template cast<C>().dot(n_j));
+		system.error += weight * trans_error * trans_error;
+
+		jacobian_trans_i = -n_i.transpose();
+		jacobian_trans_j = n_j.transpose();
+
+		system.h_ii += (weight * jacobian_trans_i.transpose() * jacobian_trans_i).template cast<T>();
+		system.h_jj += (weight * jacobian_trans_j.transpose() * jacobian_trans_j).template cast<T>();
+		system.h_ij += (weight * jacobian_trans_i.transpose() * jacobian_trans_j).template cast<T>();
+		system.g_i += (weight * jacobian_trans_i.transpose() * trans_error).template cast<T>();
+		system.g_j += (weight * jacobian_trans_j.transpose() * trans_error).template cast<T>();
+	}
+}
+
+template<typename C, class THessian>
+TSolverResult CCalibFromPlanes::solveTranslationWith(const std::vector<Eigen::Matrix4f> &sensor_poses, const TPlaneCorrespTable &corresp) const
+{
+	typedef typename THessian::Scalar T;
+	const int num_sensors = sensor_poses.size();
+	typename THessian::Vector update_vector;
+	T init_error = 0, conditioning = 0;
+	TSolverResult result;
+	result.num_iters = 0;
+	result.estimate = sensor_poses;
+
+	// The poses are updated in the precision of the normal equations, and only the estimate is returned in Scalar
+	std::vector<Eigen::Matrix<T,4,4>> estimated_poses = castPoses<T>(sensor_poses);
+
+	std::vector<std::pair<int,int>> sensor_pairs;
+	for(const auto &pair_range : corresp.pair_ranges)
+		sensor_pairs.push_back(pair_range.first);
+
+	THessian hessian;
+	hessian.init(num_sensors, sensor_pairs, params->solver.sparse_min_sensors);
+	TPairSystem<T> pair_system;
+
+	std::vector<std::array<size_t,2>> ranges;
+	for(const auto &pair_range : corresp.pair_ranges)
+		ranges.push_back(pair_range.second);
+
+	TPairChunks<T> chunks;
+	chunks.init(ranges, std::max(1, params->solver.accumulation_chunk_size));
+	accumulateChunks(chunks, [&](const std::array<size_t,2> &range, TPairSystem<T> &system)
+	{ accumulateTranslation<C>(estimated_poses, corresp, range[0], range[1], system); });
+
+	for(size_t p = 0; p < sensor_pairs.size(); p++)
+	{
+		chunks.reduce(p, pair_system);
+		init_error += pair_system.error;
+		hessian.add(sensor_pairs[p].first, sensor_pairs[p].second, pair_system);
+	}
+
+	result.init_error = result.final_error = init_error;
+	const bool solved = hessian.solve(update_vector, conditioning, eigenvalue_ratio_threshold);
+	result.conditioning = conditioning;
+	if(!solved)
+	{
+		result.msg = "System is badly conditioned. Please try again with a new set of observations.";
+		return result;
+	}
+
+	// Update the translation (Linear Least-Squares -> exact solution)
+	for(int sensor_id = 1; sensor_id < num_sensors; sensor_id++)
+		estimated_poses[sensor_id].template block<3,1>(0,3) += update_vector.template segment<3>(3 * (sensor_id - 1));
+
+	result.num_iters = 1;
+	result.final_error = computeTranslationResidual<C,T>(estimated_poses, corresp);
+	result.estimate = castPoses<Scalar>(estimated_poses);
+	result.msg = "Convergence";
+
+	return result;
+}
+
+TSolverResult CCalibFromPlanes::solveTranslation(const std::vector<Eigen::Matrix4f> &sensor_poses, const TPlaneCorrespTable &corresp) const
+{
+	return dispatchSolver<3>(params->solver.precision, sensor_poses.size(), [&](auto types)
+	{ return solveTranslationWith<typename decltype(types)::Compute, typename decltype(types)::Hessian>(sensor_poses, corresp); });
+}
+
+Scalar CCalibFromPlanes::computeCalibration()
+{
+	result = solveCalibration(sync_model->getSensorPoses(), m_plane_corresp);
+	return result.final_error;
+}
+
+template<typename C, typename T>
+T CCalibFromPlanes::computeCalibrationResidual(const std::vector<Eigen::Matrix<T,4,4>> &sensor_poses, const TPlaneCorrespTable &corresp) const
+{
+	T sum_squared_error = 0.;
+	const C distance_weight = params->solver.joint_distance_weight;
+
+	for(const TPlaneCorresp &row : corresp.rows)
+	{
+		Eigen::Matrix<C,3,1> n_i = sensor_poses[row.sensor_i].template block<3,3>(0,0).template cast<C>() * row.n_i.cast<C>();
+		Eigen::Matrix<C,3,1> n_j = sensor_poses[row.sensor_j].template block<3,3>(0,0).template cast<C>() * row.n_j.cast<C>();
+
+		Eigen::Matrix<C,3,1> rot_error = (n_i - n_j);
+		C trans_error = (C(row.d_i) - sensor_poses[row.sensor_i].template block<3,1>(0,3).template cast<C>().dot(n_i)) - (C(row.d_j) - sensor_poses[row.sensor_j].template block<3,1>(0,3).template cast<C>().dot(n_j));
+		sum_squared_error += C(row.weight) * (rot_error.dot(rot_error) + distance_weight * trans_error * trans_error);
+	}
+
+	return sum_squared_error;
+}
+
+template<typename C, typename T>
+void CCalibFromPlanes::accumulateCalibration(const std::vector<Eigen::Matrix<T,4,4>> &sensor_poses, const TPlaneCorrespTable &corresp, const size_t &begin, const size_t &end,
+                                             TPairSystem<T,6> &system) const
+{
+	Eigen::Matrix<C,4,6> jacobian_i, jacobian_j; // Jacobians of the rotation and translation
+	Eigen::Matrix<C,4,1> error;
+	Eigen::Matrix<C,4,1> error_weights(1, 1, 1, params->solver.joint_distance_weight);
+	system.setZero();
+
+	// For R <- exp(w) R the normal moves by w x (R n), so the distance d - t.(R n) moves by w.(t x R n)
+	for(size_t k = begin; k < end; k++)
+	{
+		const TPlaneCorresp &row = corresp.rows[k];
+		const C weight = row.weight;
+		const Eigen::Matrix<C,3,1> t_i = sensor_poses[row.sensor_i].template block<3,1>(0,3).template cast<C>(), t_j = sensor_poses[row.sensor_j].template block<3,1>(0,3).template cast<C>();
+
+		Eigen::Matrix<C,3,1> n_i = sensor_poses[row.sensor_i].template block<3,3>(0,0).template cast<C>() * row.n_i.cast<C>();
+		Eigen::Matrix<C,3,1> n_j = sensor_poses[row.sensor_j].template block<3,3>(0,0).template cast<C>() * row.n_j.cast<C>();
+
+		error.template head<3>() = n_i - n_j;
+		error(3) = (C(row.d_i) - t_i.dot(n_i)) - (C(row.d_j) - t_j.dot(n_j));
+		system.error += weight * error.dot(error_weights.cwiseProduct(error));
+
+		jacobian_i.setZero();
+		jacobian_i.template block<3,3>(0,0) = -skew(n_i);
+		jacobian_i.template block<1,3>(3,0) = t_i.cross(n_i).transpose();
+		jacobian_i.template block<1,3>(3,3) = -n_i.transpose();
+
+		jacobian_j.setZero();
+		jacobian_j.template block<3,3>(0,0) = skew(n_j);
+		jacobian_j.template block<1,3>(3,0) = -t_j.cross(n_j).transpose();
+		jacobian_j.template block<1,3>(3,3) = n_j.transpose();
+
+		const Eigen::Matrix<C,6,4> weighted_jacobian_i = weight * jacobian_i.transpose() * error_weights.asDiagonal();
+		const Eigen::Matrix<C,6,4> weighted_jacobian_j = weight * jacobian_j.transpose() * error_weights.asDiagonal();
+
+		system.h_ii += (weighted_jacobian_i * jacobian_i).template cast<T>();
+		system.h_jj += (weighted_jacobian_j * jacobian_j).template cast<T>();
+		system.h_ij += (weighted_jacobian_i * jacobian_j).template cast<T>();
+		system.g_i += (weighted_jacobian_i * error).template cast<T>();
+		system.g_j += (weighted_jacobian_j * error).template cast<T>();
+	}
+}
+
+template<typename C, class THessian>
+TSolverResult CCalibFromPlanes::solveCalibrationWith(const std::vector<Eigen::Matrix4f> &sensor_poses, const TPlaneCorrespTable &corresp) const
+{
+	typedef typename THessian::Scalar T;
+	const int num_sensors = sensor_poses.size();
+	typename THessian::Vector update_vector;
+	T error, new_error, init_error, conditioning = 0;
+	TSolverResult result;
+
+	// The poses are iterated in the precision of the normal equations, and only the estimate is returned in Scalar
+	std::vector<Eigen::Matrix<T,4,4>> estimated_poses = castPoses<T>(sensor_poses);
+	std::vector<Eigen::Matrix<T,4,4>> estimated_poses_temp = estimated_poses;
+
+	T increment = 1000, diff_error = 1000;
+	int it = 0;
+
+	init_error = new_error = error = computeCalibrationResidual<C,T>(estimated_poses, corresp);
+
+	// The closed form rotations replace the initial ones only when they fit the correspondences better
+	if(params->solver.closed_form_init)
+	{
+		std::vector<TPairRotationStats> pair_stats;
+		computeRotationStats(corresp, pair_stats);
+
+		std::vector<Eigen::Matrix<T,4,4>> closed_form_poses = estimated_poses;
+		computeRotationInit(pair_stats, closed_form_poses);
+
+		T closed_form_error = computeCalibrationResidual<C,T>(closed_form_poses, corresp);
+		if(closed_form_error < init_error)
+		{
+			estimated_poses = estimated_poses_temp = closed_form_poses;
+			new_error = error = closed_form_error;
+		}
+	}
+
+	std::vector<std::pair<int,int>> sensor_pairs;
+	std::vector<std::array<size_t,2>> ranges;
+	for(const auto &pair_range : corresp.pair_ranges)
+	{
+		sensor_pairs.push_back(pair_range.first);
+		ranges.push_back(pair_range.second);
+	}
+
+	THessian hessian; // Hessian of the rotation and translation of all the sensors
+	hessian.init(num_sensors, sensor_pairs, params->solver.sparse_min_sensors);
+	TPairSystem<T,6> pair_system;
+
+	TPairChunks<T,6> chunks;
+	chunks.init(ranges, std::max(1, params->solver.accumulation_chunk_size));
+
+	while(it < params->solver.max_iters && increment > params->solver.min_update && diff_error > params->solver.converge_error)
+	{
+		// Calculate the hessian and the gradient at the current estimate
+		hessian.setZero();
+		error = 0.0;
+
+		accumulateChunks(chunks, [&](const std::array<size_t,2> &range, TPairSystem<T,6> &system)
+		{ accumulateCalibration<C>(estimated_poses, corresp, range[0], range[1], system); });
+
+		for(size_t p = 0; p < sensor_pairs.size(); p++)
+		{
+			chunks.reduce(p, pair_system);
+			error += pair_system.error;
+			hessian.add(sensor_pairs[p].first, sensor_pairs[p].second, pair_system);
+		}
+
+		if(!hessian.solve(update_vector, conditioning, eigenvalue_ratio_threshold))
+		{
+			result.msg = "System is badly conditioned. Please try again with a new set of observations.";
+			break;
+		}
+
+		// Update the poses, the rotation on its manifold and the translation additively
+		for(int sensor_id = 1; sensor_id < num_sensors; sensor_id++)
+		{
+			mrpt::poses::CPose3D pose;
+			mrpt::math::CArrayNumeric<double,3> rot_manifold;
+			rot_manifold[0] = update_vector(6*sensor_id-6,0);
+			rot_manifold[1] = update_vector(6*sensor_id-5,0);
+			rot_manifold[2] = update_vector(6*sensor_id-4,0);
+			mrpt::math::CMatrixDouble33 update_rot = pose.exp_rotation(rot_manifold);
+			Eigen::Matrix<T,3,3> update_rot_eig;
+			update_rot_eig << update_rot(0,0), update_rot(0,1), update_rot(0,2),
+			        update_rot(1,0), update_rot(1,1), update_rot(1,2),
+			        update_rot(2,0), update_rot(2,1), update_rot(2,2);
+			estimated_poses_temp[sensor_id] = estimated_poses[sensor_id];
+			estimated_poses_temp[sensor_id].template block<3,3>(0,0) = update_rot_eig * estimated_poses[sensor_id].template block<3,3>(0,0);
+			estimated_poses_temp[sensor_id].template block<3,1>(0,3) += update_vector.template segment<3>(6*sensor_id-3);
+		}
+
+		new_error = computeCalibrationResidual<C,T>(estimated_poses_temp, corresp);
+
+		//Assign new poses
+		if(new_error < error)
+			for(int sensor_id = 1; sensor_id < num_sensors; sensor_id++)
+				estimated_poses[sensor_id] = estimated_poses_temp[sensor_id];
+
+		increment = update_vector.dot(update_vector);
+		diff_error = error - new_error;
+		++it;
+	}
+
+	if(it == params->solver.max_iters)
+		result.msg = "Maximum iterations reached.";
+	else if(increment < params->solver.min_update)
+		result.msg = "Increment too small.";
+	else if(diff_error < params->solver.converge_error)
+		result.msg = "Convergence";
+
+	result.init_error = init_error;
+	result.num_iters = it;
+	result.final_error = std::min(new_error, error);
+	result.conditioning = conditioning;
+	result.estimate = castPoses<Scalar>(estimated_poses);
+
+	return result;
+}
+
+TSolverResult CCalibFromPlanes::solveCalibration(const std::vector<Eigen::Matrix4f> &sensor_poses, const TPlaneCorrespTable &corresp) const
+{
+	return dispatchSolver<6>(params->solver.precision, sensor_poses.size(), [&](auto types)
+	{ return solveCalibrationWith<typename decltype(types)::Compute, typename decltype(types)::Hessian>(sensor_poses, corresp); });
 }
@@ -9,9 +9,13 @@
 #pragma once
 
 #include "CExtrinsicCalib.h"
+#include "CBlockHessian.h"
 #include "TCalibFromPlanesParams.h"
 #include "TSolverResult.h"
+#include "TThresholdSweepPoint.h"
+#include "TPlaneCorrespTable.h"
 #include <CPlane.h>
+#include <mrpt/img/TCamera.h>
 //#include <mrpt/pbmap/PbMap.h>
 //#include <mrpt/pbmap/Miscellaneous.h>
 #include <map>
@@ -41,6 +45,22 @@ class CCalibFromPlanes : public CExtrinsicCalib
 	 */
 	std::map<int,std::map<int,std::vector<std::array<int,3>>>> mmv_plane_corresp;
 
+	/** Whether each pair of sensors may observe a common region, indexed [sensor_i][sensor_j]. Empty until computeSensorOverlap() is run. */
+	std::vector<std::vector<bool>> m_sensor_overlap;
+
+	/** The intrinsics and range limits the overlap was computed from, to compute it again when the initial calibration is edited. */
+	std::vector<mrpt::img::TCamera> mv_sensor_cameras;
+	std::vector<Scalar> mv_sensor_max_ranges;
+
+	/** The matches of each sensor pair [sensor_i, sensor_j] per set, kept when incremental_matching is set. */
+	std::map<std::pair<int,int>,std::map<int,TSetPairMatches>> m_pair_matches;
+
+	/** The ids of the sets the planes were matched in, kept with m_pair_matches to match the pairs that were pruned before. */
+	std::vector<int> mv_matched_sets;
+
+	/** The plane correspondences with their plane data resolved, built from mmv_plane_corresp for the solvers. */
+	TPlaneCorrespTable m_plane_corresp;
+
 	/*! Covariance matrices */
     std::vector< Eigen::Matrix<Scalar,3,3>, Eigen::aligned_allocator<Eigen::Matrix<Scalar,3,3> > > covariance_rot;
     std::vector< Eigen::Matrix<Scalar,3,3>, Eigen::aligned_allocator<Eigen::Matrix<Scalar,3,3> > > m_covariance_trans;
@@ -59,13 +79,123 @@ class CCalibFromPlanes : public CExtrinsicCalib
 	 */
 	void segmentPlanes(const pcl::PointCloud<pcl::PointXYZRGBA>::Ptr &cloud, std::vector<CPlaneCHull> &planes);
 
+	/**
+	 * \brief Tracks the planes of the previous observation of a sensor into its next observation.
+	 * The previous inlier masks are checked first, and the pixels that still lie on (a refit of) each previous plane, within
+	 * tracking_dist_factor times dist_threshold, seed a region growing over the new cloud. New planes are not discovered, so the caller should fall back to
+	 * segmentPlanes() when the returned confidence drops.
+	 * @param cloud the input cloud.
+	 * @param prev_planes the planes segmented from the previous observation of the same sensor.
+	 * @param planes the tracked planes.
+	 * @return the tracking confidence, i.e. the fraction of the previous inliers that were recovered as seeds.
+	 */
+	Scalar trackPlanes(const pcl::PointCloud<pcl::PointXYZRGBA>::Ptr &cloud, const std::vector<CPlaneCHull> &prev_planes, std::vector<CPlaneCHull> &planes);
+
+	/**
+	 * \brief Segments the planes of a sensor guided by the planes of the reference sensor in the same set.
+	 * The reference planes are transformed into the sensor's frame with the initial poses, and each one is searched only
+	 * within the bounding box of its projected convex hull and the band of depths its uncertainty allows: a RANSAC of
+	 * guided_ransac_iters hypotheses over at most guided_max_ransac_samples pixels of that band picks the plane, which then
+	 * grows through growPlane(). No normals are estimated. When the pixels left unexplained amount to more than
+	 * guided_leftover_frac of the valid pixels, they alone are segmented by the same sampling and growing, with hypotheses
+	 * fitted to local neighbourhoods, until guided_max_failures hypotheses in a row fail to grow into a plane.
+	 * @param cloud the input cloud.
+	 * @param sensor_id the id of the sensor the cloud belongs to.
+	 * @param camera the intrinsic parameters of the depth camera the cloud was projected from.
+	 * @param ref_planes the planes segmented from the reference sensor's observation in the same set.
+	 * @param planes the segmented planes.
+	 */
+	void segmentPlanesGuided(const pcl::PointCloud<pcl::PointXYZRGBA>::Ptr &cloud, const int &sensor_id, const mrpt::img::TCamera &camera,
+	                         const std::vector<CPlaneCHull> &ref_planes, std::vector<CPlaneCHull> &planes);
+
+	/**
+	 * \brief Grows a planar region over the organized cloud, through 4-connectivity, from the given seed pixels.
+	 * Pixels are added while they lie within the segmentation distance threshold of the plane, and are marked in
+	 * the label image so that they can not be claimed by another region.
+	 * @param cloud the input cloud.
+	 * @param seeds the seed pixel indices.
+	 * @param plane the plane the region belongs to. On success it is refitted to the grown region, with its inliers and convex hull.
+	 * @param labels per-pixel region labels, -1 for unlabelled pixels.
+	 * @param label the label given to the pixels of the region.
+	 * @return whether the region has enough inliers and is flat enough to be kept. Otherwise its pixels are unlabelled again.
+	 */
+	bool growPlane(const pcl::PointCloud<pcl::PointXYZRGBA>::Ptr &cloud, const std::vector<int> &seeds, CPlaneCHull &plane, std::vector<int> &labels, const int &label);
+
+	/**
+	 * Predicts which pairs of sensors may observe a common region, from their initial poses, intrinsics and range limits.
+	 * The frustum of one sensor is sampled on a grid of pixels and depths, and the pair overlaps when any sample projects
+	 * into the image of the other within its range, the image being widened by the angular uncertainty of both sensors
+	 * and the range by their distance uncertainty.
+	 * \param cameras the intrinsic parameters of the depth camera of each sensor.
+	 * \param max_ranges the maximum range of each sensor.
+	 */
+	void computeSensorOverlap(const std::vector<mrpt::img::TCamera> &cameras, const std::vector<Scalar> &max_ranges);
+
+	/** Returns whether two sensors may observe a common region (always true before computeSensorOverlap() is run). */
+	bool sensorsOverlap(const int &sensor_i, const int &sensor_j) const;
+
 	/**
 	 * Search for potential plane matches between each sensor pair in a sync obs set.
-	 * \param planes planes extracted from sensor observations that belong to the same synchronized set. planes[sensor_id][plane_id] gives a plane.
+	 * The planes of each sensor are transformed to the common frame once and the gates are evaluated for all the plane pairs of two sensors at once,
+	 * or only for the pairs whose normals are close according to a CNormalSphereIndex when use_normal_index is set.
+	 * The sensor pairs without a predicted common view are skipped when prune_sensor_pairs is set.
+	 * With use_descriptors set, the descriptors of the planes must be similar within descriptor_tolerance.
+	 * With hull_overlap_filter set, the convex hulls of the planes must also overlap, which requires them to be calculated
+	 * beforehand when several sets are matched concurrently.
+	 * \param planes planes extracted from sensor observations that belong to the same synchronized set. (*planes[sensor_id])[plane_id] gives a plane,
+	 * and planes[sensor_id] is null when the sensor has no observation in the set.
 	 * \param set_id the id of the synchronized set the planes belong to.
-	 * \param params the parameters for plane matching.
+	 * \param corresp the correspondences found are appended here, in the same layout as mmv_plane_corresp.
+	 * The method only writes to this output, so different sets can be matched concurrently.
+	 * \param pair_matches if not null, the matches of each sensor pair are also stored here with the calibration they were found
+	 * under and the slack of the gates, for rematchSensorPairs(). Computing the slack evaluates the gates for all the plane pairs.
+	 * \param thresholds if not null, the angular (in degrees) and distance thresholds of the gates for all the sensors, instead of their uncertainties.
+	 * \return the number of sensor pairs whose indexed matches differ from the brute force ones, when verify_normal_index is set.
+	 */
+	size_t findPotentialMatches(const std::vector<const std::vector<CPlaneCHull>*> &planes, const int &set_id, std::map<int,std::map<int,std::vector<std::array<int,3>>>> &corresp,
+	                            std::map<std::pair<int,int>,TSetPairMatches> *pair_matches = nullptr, const Eigen::Vector2f *thresholds = nullptr);
+
+	/**
+	 * Re-matches the sensor pairs of a sensor whose initial pose or uncertainty was edited, and rebuilds their entries of mmv_plane_corresp.
+	 * A set is skipped when the edit moves the normals and distances of the planes (and the thresholds) by less than the slack
+	 * of its gates, as no decision can change then. The stale sets are matched in parallel.
+	 * With prune_sensor_pairs set, the overlap of the sensors is computed again first: the pairs of the sensor that no longer
+	 * overlap are dropped, and those that were pruned before and overlap now are matched in all the sets of mv_matched_sets.
+	 * \param sensor_id the id of the edited sensor.
+	 * \return the number of sensor pair and set combinations that were re-matched or dropped.
+	 */
+	size_t rematchSensorPairs(const int &sensor_id);
+
+	/**
+	 * Builds m_plane_corresp from mmv_plane_corresp, looking up the observation ids and the planes of each correspondence once.
+	 * All the correspondences get a unit weight.
+	 */
+	void buildCorrespTable();
+
+	/** Builds a correspondence table from correspondences in the layout of mmv_plane_corresp. */
+	void buildCorrespTable(const std::map<int,std::map<int,std::vector<std::array<int,3>>>> &corresp, TPlaneCorrespTable &table) const;
+
+	/**
+	 * Removes from m_plane_corresp the correspondences that disagree with the consensus relative rotation of their sensor pair.
+	 * For each pair, rotations are hypothesized by Kabsch from two correspondences with distinct normals, those further from
+	 * the initial relative rotation than the sensors' uncertainties are discarded, and the one with the largest support is refined
+	 * on its inliers. The inliers are the correspondences whose normals agree within ransac_angle_threshold.
+	 * The pairs are processed in parallel, each with its own deterministically seeded generator.
 	 */
-	void findPotentialMatches(const std::vector<std::vector<CPlaneCHull>> &planes, const int &set_id);
+	void filterCorrespondences();
+
+	/**
+	 * Collapses the correspondences of m_plane_corresp that observe the same physical planes in different sets.
+	 * The planes of all the sensors of each set are brought to the rig frame through the initial calibration, and the motion of the rig
+	 * since the first set is registered on the planes tracked so far. The planes are then associated to those tracks in the common frame
+	 * (within track_angle_threshold and track_dist_threshold), and the planes that match no track start a new one.
+	 * With split_viewpoints set (the default), the correspondences between the same two tracks are replaced by one weighted mean per
+	 * viewpoint, the normals of both sensors staying within viewpoint_angle_threshold of those of its first correspondence, which keeps
+	 * the geometric diversity of a moving rig. Otherwise all the correspondences of the two tracks are averaged into one.
+	 * Each collapsed row keeps the set, observation and plane ids of its first correspondence, so publishCorrespPlanes() shows it
+	 * under that set only.
+	 */
+	void clusterCorrespondences();
 
     /** Calculate the residual error of the correspondences.
         \param sensor_poses relative poses of the sensors
@@ -77,21 +207,145 @@ class CCalibFromPlanes : public CExtrinsicCalib
         \return the residual */
 	virtual Scalar computeRotationResidual();
 
+	/**
+	 * Calculate the angular residual error of the given correspondences under the given poses.
+	 * \tparam C the precision of the arithmetic of each correspondence.
+	 * \tparam T the precision of the poses and of the sum.
+	 */
+	template<typename C = Scalar, typename T = Scalar>
+	T computeRotationResidual(const std::vector<Eigen::Matrix<T,4,4>> &sensor_poses, const TPlaneCorrespTable &corresp) const;
+
+	/** Calculate the angular residual error under the given poses from the per-pair sums of the correspondences, in double precision. */
+	template<typename T>
+	double computeRotationResidual(const std::vector<Eigen::Matrix<T,4,4>> &sensor_poses, const std::vector<TPairRotationStats> &pair_stats) const;
+
+	/** Reduces the correspondences of each sensor pair to the sums the rotation solver depends on, in the order of corresp.pair_ranges. */
+	void computeRotationStats(const TPlaneCorrespTable &corresp, std::vector<TPairRotationStats> &pair_stats) const;
+
+	/** Accumulates the rotation normal equations of the correspondences [begin, end) of a sensor pair, each evaluated in precision C and summed in precision T. */
+	template<typename C, typename T>
+	void accumulateRotation(const std::vector<Eigen::Matrix<T,4,4>> &sensor_poses, const TPlaneCorrespTable &corresp, const size_t &begin, const size_t &end,
+	                        TPairSystem<T> &system) const;
+
+	/**
+	 * Runs accumulate(range, system) over every chunk of correspondences of a TPairChunks, in parallel threads when parallel_accumulation is set.
+	 * Each chunk writes only its own partial system, which TPairChunks::reduce() then sums in a fixed order.
+	 */
+	template<class TChunks, class TAccumulate>
+	void accumulateChunks(TChunks &chunks, const TAccumulate &accumulate) const;
+
+	/** Calculates the rotation normal equations of a sensor pair from the sums of its correspondences. */
+	template<typename T>
+	void accumulateRotation(const std::vector<Eigen::Matrix<T,4,4>> &sensor_poses, const TPairRotationStats &stats, TPairSystem<T> &system) const;
+
+	/**
+	 * Calculates the rotations of the sensors in closed form, as a starting point for the rotation solver.
+	 * The relative rotation of each sensor pair is solved by Kabsch over its correspondences, and the rotations are chained from
+	 * the reference sensor over a maximum spanning tree of the pairs, weighted by how well their normals determine the rotation.
+	 * \param pair_stats the per-pair sums of the correspondences.
+	 * \param sensor_poses the poses whose rotations are replaced. The reference sensor, and the sensors that no well determined
+	 * pair connects to it, keep theirs.
+	 */
+	template<typename T>
+	void computeRotationInit(const std::vector<TPairRotationStats> &pair_stats, std::vector<Eigen::Matrix<T,4,4>> &sensor_poses) const;
+
 //    /** Calculate the translational residual error of the correspondences.
 //        \param sensor_poses relative poses of the sensors
 //        \return the residual */
 //    virtual Scalar computeTranslationResidual(const std::vector<mrpt::math::CMatrixFixedNumeric<Scalar,4,4> > & sensor_poses);
 
-//    /** Compute Calibration.
-//        \param sensor_poses initial calibration
-//        \return the residual */
-//    virtual Scalar computeCalibration(const std::vector<mrpt::math::CMatrixFixedNumeric<Scalar,4,4> > & sensor_poses);
+    /** Compute Calibration, solving the rotation and translation jointly from the initial calibration (see solveCalibration()).
+        \return the residual */
+	virtual Scalar computeCalibration();
 
     /** Compute Calibration (only rotation).
         \return the residual */
 	virtual Scalar computeRotation();
 
-    /** Compute Calibration (only translation).
+	/**
+	 * Runs the rotation solver from the given poses over the given correspondences.
+	 * It only reads the parameters and the correspondences, so several problems can be solved concurrently.
+	 * With sufficient_statistics set, the correspondences are first reduced to per-pair sums, and the iterations work on those alone.
+	 * With closed_form_init set, the solver starts from computeRotationInit() when that lowers the residual.
+	 * The Hessian only holds the blocks of the observed sensor pairs (see CBlockHessian), and rigs of 2 to 4 sensors
+	 * use fixed-size normal equations instead (see CFixedHessian). Both are evaluated in the precision given by the precision parameter.
+	 * \param sensor_poses the initial poses of the sensors.
+	 * \param corresp the correspondences.
+	 * \return the result of the solver, with the conditioning of its last system.
+	 */
+	TSolverResult solveRotation(const std::vector<Eigen::Matrix4f> &sensor_poses, const TPlaneCorrespTable &corresp) const;
+
+	/** The rotation solver over normal equations of the given type, CBlockHessian or CFixedHessian, each correspondence being evaluated in precision C. */
+	template<typename C, class THessian>
+	TSolverResult solveRotationWith(const std::vector<Eigen::Matrix4f> &sensor_poses, const TPlaneCorrespTable &corresp) const;
+
+	/**
+	 * Matches and solves the rotation over a grid of uniform matching thresholds, reusing the extracted planes.
+	 * The sets are matched once at the loosest thresholds, since a pair accepted at a tight threshold is also accepted at looser ones,
+	 * and each grid point keeps the correspondences that pass its own thresholds. The grid points are solved in parallel,
+	 * unless parallel_accumulation is set, in which case each solve is parallel instead.
+	 * The descriptor and hull overlap gates apply as in findPotentialMatches(); the RANSAC filter and the track clustering do not.
+	 * \param planes the planes of each set, as passed to findPotentialMatches().
+	 * \param set_ids the ids of the sets.
+	 * \param angle_thresholds the angular thresholds of the grid, in degrees.
+	 * \param dist_thresholds the distance thresholds of the grid, in meters.
+	 * \return one point per pair of thresholds, ordered by angle and then by distance, both ascending.
+	 */
+	std::vector<TThresholdSweepPoint> sweepThresholds(const std::vector<std::vector<const std::vector<CPlaneCHull>*>> &planes, const std::vector<int> &set_ids,
+	                                                  std::vector<Scalar> angle_thresholds, std::vector<Scalar> dist_thresholds);
+
+    /** Compute Calibration (only translation), from the rotations estimated by computeRotation() when it was run.
         \return the residual */
 	virtual Scalar computeTranslation();
+
+	/** Calculate the translational residual error of the given correspondences under the given poses, as computeRotationResidual(). */
+	template<typename C = Scalar, typename T = Scalar>
+	T computeTranslationResidual(const std::vector<Eigen::Matrix<T,4,4>> &sensor_poses, const TPlaneCorrespTable &corresp) const;
+
+	/** Accumulates the translation normal equations of the correspondences [begin, end) of a sensor pair, each evaluated in precision C and summed in precision T. */
+	template<typename C, typename T>
+	void accumulateTranslation(const std::vector<Eigen::Matrix<T,4,4>> &sensor_poses, const TPlaneCorrespTable &corresp, const size_t &begin, const size_t &end,
+	                           TPairSystem<T> &system) const;
+
+	/**
+	 * Solves the translations of the sensors for fixed rotations, as a linear least-squares problem over the plane distances.
+	 * Like solveRotation(), it only reads the parameters and the correspondences.
+	 * \param sensor_poses the poses of the sensors, whose rotations are kept.
+	 * \param corresp the correspondences.
+	 * \return the result of the solver, with one iteration unless the system is badly conditioned.
+	 */
+	TSolverResult solveTranslation(const std::vector<Eigen::Matrix4f> &sensor_poses, const TPlaneCorrespTable &corresp) const;
+
+	/** The translation solver over normal equations of the given type, CBlockHessian or CFixedHessian, each correspondence being evaluated in precision C. */
+	template<typename C, class THessian>
+	TSolverResult solveTranslationWith(const std::vector<Eigen::Matrix4f> &sensor_poses, const TPlaneCorrespTable &corresp) const;
+
+	/** Calculate the joint residual error of the given correspondences under the given poses, the distance errors being weighted by joint_distance_weight. */
+	template<typename C = Scalar, typename T = Scalar>
+	T computeCalibrationResidual(const std::vector<Eigen::Matrix<T,4,4>> &sensor_poses, const TPlaneCorrespTable &corresp) const;
+
+	/**
+	 * Accumulates the joint normal equations of the correspondences [begin, end) of a sensor pair, with the rotation and then the translation parameters of each sensor.
+	 * Each correspondence is evaluated in precision C and summed in precision T.
+	 */
+	template<typename C, typename T>
+	void accumulateCalibration(const std::vector<Eigen::Matrix<T,4,4>> &sensor_poses, const TPlaneCorrespTable &corresp, const size_t &begin, const size_t &end,
+	                           TPairSystem<T,6> &system) const;
+
+	/**
+	 * Solves the rotations and translations of the sensors jointly, by Gauss-Newton over the plane parameters of the correspondences.
+	 * The residual of a correspondence is the difference of its planes in the common frame, [R_i n_i - R_j n_j; d_i - t_i.(R_i n_i) - d_j + t_j.(R_j n_j)],
+	 * the distance term being weighted by joint_distance_weight. Each step solves a rotation increment w and a translation increment dt per sensor,
+	 * applied on SO(3) x R^3 as R <- exp(w) R and t <- t + dt, and is kept only when it lowers the residual.
+	 * Like solveRotation(), it only reads the parameters and the correspondences, and starts from computeRotationInit() with closed_form_init set
+	 * when that lowers the residual.
+	 * \param sensor_poses the initial poses of the sensors.
+	 * \param corresp the correspondences.
+	 * \return the result of the solver, with the conditioning of its last system.
+	 */
+	TSolverResult solveCalibration(const std::vector<Eigen::Matrix4f> &sensor_poses, const TPlaneCorrespTable &corresp) const;
+
+	/** The joint solver over normal equations of the given type, CBlockHessian or CFixedHessian with 6 parameters per sensor, each correspondence being evaluated in precision C. */
+	template<typename C, class THessian>
+	TSolverResult solveCalibrationWith(const std::vector<Eigen::Matrix4f> &sensor_poses, const TPlaneCorrespTable &corresp) const;
 };
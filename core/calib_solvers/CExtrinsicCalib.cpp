@@ -15,7 +15,6 @@ double CExtrinsicCalib::eigenvalue_ratio_threshold = 2e-4;
 
 Scalar CExtrinsicCalib::computeCalibration()
 {
-//    std::string stats;
-//    computeRotation(sensor_poses, stats);
-//    computeTranslation(sensor_poses, stats);
+	computeRotation();
+	return computeTranslation();
 }
@@ -10,9 +10,9 @@
 
 #include "TExtrinsicCalibParams.h"
 #include <CObservationTree.h>
+#include <Scalar.h>
 #include <mrpt/math/CMatrixFixedNumeric.h>
-
-typedef float Scalar;
+#include <Eigen/SVD>
 
 /*! Generate a skew-symmetric matrix from a 3D vector */
 template<typename Scalar> inline Eigen::Matrix<Scalar,3,3> skew(const Eigen::Matrix<Scalar,3,1> &vec)
@@ -27,6 +27,15 @@ template<typename Scalar> inline Eigen::Matrix<Scalar,3,3> skew(const Eigen::Mat
   return skew_matrix;
 }
 
+/*! Find the rotation R that best aligns pairs of directions (a_k, b_k) as R a_k = b_k (Kabsch), from their correlation M = sum(w_k b_k a_k^T) */
+template<typename Scalar> inline Eigen::Matrix<Scalar,3,3> kabsch(const Eigen::Matrix<Scalar,3,3> &correlation)
+{
+  Eigen::JacobiSVD<Eigen::Matrix<Scalar,3,3>> svd(correlation, Eigen::ComputeFullU | Eigen::ComputeFullV);
+  Eigen::Matrix<Scalar,3,3> reflection = Eigen::Matrix<Scalar,3,3>::Identity();
+  reflection(2,2) = (svd.matrixU() * svd.matrixV().transpose()).determinant() < 0 ? -1 : 1;
+  return svd.matrixU() * reflection * svd.matrixV().transpose();
+}
+
 /** Base class for extrinsic calibration.
  *
  * \tparam num_sensors The number of sensors to calibrate (i.e. number of sensors
@@ -72,10 +81,9 @@ public:
 //        \return the residual */
 //    virtual Scalar computeTranslationResidual(const std::vector<mrpt::math::CMatrixFixedNumeric<Scalar,4,4> > & sensor_poses) = 0;
 
-    /** Compute Calibration.
-        \param sensor_poses initial calibration
+    /** Compute Calibration, by default the rotation and then the translation.
         \return the residual */
-	virtual Scalar computeCalibration(); // = 0;
+	virtual Scalar computeCalibration();
 
     /** Compute Calibration (only rotation).
 	 * \params params the parameters related to the least-squares solver
@@ -7,6 +7,7 @@
 struct TPlaneSegmentationParams
 {
 	//params for integral normal estimation
+	//0: COVARIANCE_MATRIX, 1: AVERAGE_3D_GRADIENT, 2: AVERAGE_DEPTH_CHANGE (pcl), 3: CROSS_PRODUCT (COrganizedNormalEstimation)
 	int normal_estimation_method;
 	bool depth_dependent_smoothing;
 	double max_depth_change_factor;
@@ -22,6 +23,60 @@ struct TPlaneSegmentationParams
 	double max_cos_normal;
 	double dist_centre_plane_threshold;
 	double proximity_threshold;
+
+	//params for tracking planes between consecutive observations of a sensor
+	//the pixels of each previous plane are searched within tracking_dist_factor times dist_threshold of it, to allow for the motion
+	bool temporal_tracking = false;
+	double min_tracking_confidence = 0.8;
+	double tracking_dist_factor = 3.0;
+
+	//params for segmenting the planes of the other sensors guided by those of the reference sensor
+	bool guided_segmentation = false;
+	double guided_leftover_frac = 0.2;
+	int guided_ransac_iters = 50;
+	int guided_max_ransac_samples = 2000;
+	int guided_max_failures = 3;
+};
+
+struct TPlaneMatchingParams
+{
+	//params for skipping the sensor pairs that cannot observe a common region, predicted from the initial calibration
+	//the range of the sensors is taken from their observations unless max_sensor_range is positive
+	bool prune_sensor_pairs = false;
+	double max_sensor_range = 0;
+
+	//params for searching the candidate matches through an index over the normal sphere instead of all the plane pairs
+	bool use_normal_index = false;
+	bool verify_normal_index = false;
+
+	//params for requiring similar plane descriptors (area, elongation and mean colour) of the candidate matches
+	bool use_descriptors = false;
+	double descriptor_tolerance = 0.5;
+
+	//params for rejecting the candidate matches whose convex hulls do not overlap in the common frame
+	bool hull_overlap_filter = false;
+	double hull_overlap_margin = 0.1;
+
+	//params for keeping only the correspondences that agree with the consensus relative rotation of each sensor pair
+	bool ransac_filter = false;
+	int ransac_iters = 200;
+	double ransac_angle_threshold = 2.0;
+	double ransac_min_sample_angle = 10.0;
+
+	//params for collapsing the correspondences between the same physical planes observed in different sets
+	bool track_clustering = false;
+	double track_angle_threshold = 2.0;
+	double track_dist_threshold = 0.05;
+	bool split_viewpoints = true;
+	double viewpoint_angle_threshold = 10.0;
+
+	//params for re-matching only the sensor pairs and sets affected by an edit of the initial calibration
+	bool incremental_matching = false;
+
+	//params for matching and solving over a grid of uniform angular (degrees) and distance (meters) thresholds
+	bool threshold_sweep = false;
+	std::vector<double> sweep_angle_thresholds;
+	std::vector<double> sweep_dist_thresholds;
 };
 
 /**
@@ -40,6 +95,7 @@ struct TCalibFromPlanesParams
 {
 	int downsample_factor;
 	TPlaneSegmentationParams seg;
+	TPlaneMatchingParams match;
 	TSolverParams solver;
 	CalibFromPlanesStatus calib_status;
 };
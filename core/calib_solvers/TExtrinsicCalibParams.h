@@ -1,8 +1,38 @@
 #pragma once
 
+/**
+ * The arithmetic precision of the solvers. The correspondences are stored in float (see Scalar) in all the modes.
+ * SOLVER_MIXED evaluates each correspondence in float and accumulates the Hessians and gradients, and solves them, in double.
+ */
+enum SolverPrecision
+{
+	SOLVER_FLOAT,
+	SOLVER_MIXED,
+	SOLVER_DOUBLE
+};
+
 struct TSolverParams
 {
 	int max_iters;
 	double min_update;
 	double converge_error;
+
+	//reduce the correspondences once to per sensor pair sums, so that the iterations do not depend on their number
+	bool sufficient_statistics = false;
+
+	//start the rotation solver from the closed form rotations of the correspondences, chained over a spanning tree of the sensor pairs
+	bool closed_form_init = false;
+
+	//the number of sensors from which the normal equations are factorized as a sparse matrix
+	int sparse_min_sensors = 8;
+
+	//accumulate the normal equations over chunks of correspondences in parallel; the chunks (and so the results) do not depend on the threads
+	bool parallel_accumulation = false;
+	int accumulation_chunk_size = 4096;
+
+	//the weight of the squared distance errors (in m^2) against the squared normal errors in the joint rotation and translation solver
+	double joint_distance_weight = 1.0;
+
+	//the precision of the per correspondence arithmetic and of the accumulated normal equations
+	SolverPrecision precision = SOLVER_FLOAT;
 };
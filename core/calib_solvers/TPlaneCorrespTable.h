@@ -0,0 +1,118 @@
+/* +------------------------------------------------------------------------+
+   |                     Mobile Robot Programming Toolkit (MRPT)            |
+   |                          http://www.mrpt.org/                          |
+   |                                                                        |
+   | Copyright (c) 2005-2018, Individual contributors, see AUTHORS file     |
+   | See: http://www.mrpt.org/Authors - All rights reserved.                |
+   | Released under BSD License. See details in http://www.mrpt.org/License |
+   +------------------------------------------------------------------------+ */
+#pragma once
+
+#include <CPlane.h>
+#include <Eigen/Core>
+#include <array>
+#include <map>
+#include <vector>
+
+/** A plane correspondence with the data of both planes resolved, so that the solvers need not look them up. */
+
+struct TPlaneCorresp
+{
+	/** The id of the synchronized set the planes were observed in. */
+	int set_id;
+
+	/** The ids of the two sensors, sensor_i < sensor_j. */
+	int sensor_i, sensor_j;
+
+	/** The ids of the observations in the synchronized model. */
+	int obs_i, obs_j;
+
+	/** The ids of the planes in their observations. */
+	int plane_i, plane_j;
+
+	/** The plane parameters, in their sensors' frames. */
+	Eigen::Matrix<Scalar,3,1> n_i, n_j;
+	Scalar d_i, d_j;
+
+	/** The weight of the correspondence in the cost function. */
+	Scalar weight;
+};
+
+/**
+ * Flat store of the plane correspondences, sorted by sensor pair and then by set.
+ * The rows of a sensor pair are contiguous, and the rows of a set are found through a small index of ranges.
+ */
+
+struct TPlaneCorrespTable
+{
+	std::vector<TPlaneCorresp> rows;
+
+	/** The range [begin, end) of rows of each sensor pair. */
+	std::map<std::pair<int,int>,std::array<size_t,2>> pair_ranges;
+
+	/** The ranges [begin, end) of rows of each set, one per sensor pair with correspondences in the set. */
+	std::map<int,std::vector<std::array<size_t,2>>> set_ranges;
+
+	void clear()
+	{
+		rows.clear();
+		pair_ranges.clear();
+		set_ranges.clear();
+	}
+
+	/** Fills the range indices, after the rows have been sorted by sensor pair and set. */
+	void index()
+	{
+		pair_ranges.clear();
+		set_ranges.clear();
+
+		for(size_t begin = 0, end; begin < rows.size(); begin = end)
+		{
+			for(end = begin + 1; end < rows.size() && rows[end].sensor_i == rows[begin].sensor_i
+			    && rows[end].sensor_j == rows[begin].sensor_j && rows[end].set_id == rows[begin].set_id; end++);
+
+			set_ranges[rows[begin].set_id].push_back(std::array<size_t,2>{begin, end});
+
+			std::pair<int,int> sensor_pair(rows[begin].sensor_i, rows[begin].sensor_j);
+			if(pair_ranges.count(sensor_pair))
+				pair_ranges[sensor_pair][1] = end;
+			else
+				pair_ranges[sensor_pair] = std::array<size_t,2>{begin, end};
+		}
+	}
+};
+
+/**
+ * The matches of a sensor pair in one set, with the calibration they were found under and how far the decisions of the
+ * gates are from their thresholds, so that an edit of the calibration can tell whether they may change.
+ */
+
+struct TSetPairMatches
+{
+	/** The matches, each of the form - set_id, plane_id1, plane_id2. */
+	std::vector<std::array<int,3>> corresp;
+
+	/** The poses of both sensors and the uncertainty of the second one (which sets the thresholds) at matching time. */
+	Eigen::Matrix4f pose_i, pose_j;
+	Eigen::Vector2f uncertainty_j;
+
+	/** The smallest change of the angle between two normals (in radians) and of the difference of their distances
+	 * that could flip the decision of the gates for any plane pair. */
+	Scalar angle_slack, dist_slack;
+};
+
+/**
+ * The sums of the correspondences of a sensor pair that the rotation residual, gradient and Hessian depend on.
+ * They are kept in double precision, since the residual is recovered as a difference of them.
+ */
+
+struct TPairRotationStats
+{
+	int sensor_i, sensor_j;
+
+	/** The sum of w n_i n_j^T. */
+	Eigen::Matrix3d correlation;
+
+	/** The sums of w n_i n_i^T and w n_j n_j^T. */
+	Eigen::Matrix3d scatter_i, scatter_j;
+};
@@ -16,6 +16,9 @@ struct TSolverResult
 	/** The error with the estimated parameters. */
 	float final_error;
 
+	/** The ratio of the smallest to the largest pivot of the LDLT factorization of the last Hessian solved, 0 when it is singular. */
+	float conditioning;
+
 	/** The estimated parameters. */
 	std::vector<Eigen::Matrix4f> estimate;
 
@@ -0,0 +1,29 @@
+/* +------------------------------------------------------------------------+
+   |                     Mobile Robot Programming Toolkit (MRPT)            |
+   |                          http://www.mrpt.org/                          |
+   |                                                                        |
+   | Copyright (c) 2005-2018, Individual contributors, see AUTHORS file     |
+   | See: http://www.mrpt.org/Authors - All rights reserved.                |
+   | Released under BSD License. See details in http://www.mrpt.org/License |
+   +------------------------------------------------------------------------+ */
+#pragma once
+
+#include "TSolverResult.h"
+#include <cstddef>
+
+/** Structure meant to hold the outcome of matching and solving with one pair of thresholds of a sweep. */
+
+struct TThresholdSweepPoint
+{
+	/** The angular (in degrees) and distance (in meters) thresholds of the matching gates. */
+	float angle_threshold, dist_threshold;
+
+	/** The number of correspondences accepted. */
+	size_t num_corresp;
+
+	/** The number of sensor pairs with correspondences. */
+	size_t num_pairs;
+
+	/** The result of the rotation solver over the accepted correspondences. */
+	TSolverResult result;
+};
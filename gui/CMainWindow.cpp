@@ -424,6 +424,9 @@ void CMainWindow::initCalibChanged(double value)
 
 		m_sync_model->setSensorPose(sensor_poses[sensor_index], sensor_index);
 	}
+
+	if((m_calib_from_planes_gui != nullptr) && (m_calib_from_planes_gui->calibStatus() == CalibFromPlanesStatus::PLANES_MATCHED))
+		m_calib_from_planes_gui->rematchPlanes(sensor_index);
 }
 
 void CMainWindow::treeItemClicked(const QModelIndex &index)
@@ -34,6 +34,8 @@ void CCalibFromPlanesConfig::setConfig(mrpt::config::CConfigFile &config_file)
 		m_ui->ne_method_cbox->setCurrentIndex(1);
 	else if(ne_method_string == "AVERAGE_DEPTH_CHANGE")
 		m_ui->ne_method_cbox->setCurrentIndex(2);
+	else if(ne_method_string == "CROSS_PRODUCT")
+		m_ui->ne_method_cbox->setCurrentIndex(3);
 	else
 		m_ui->ne_method_cbox->setCurrentIndex(0);
 
@@ -51,9 +53,52 @@ void CCalibFromPlanesConfig::setConfig(mrpt::config::CConfigFile &config_file)
 	m_ui->max_cos_normal_sbox->setValue(m_config_file.read_double("plane_segmentation", "max_cos_normal", 0.998, true));
 	m_ui->dist_centre_plane_sbox->setValue(m_config_file.read_double("plane_segmentation", "dist_centre_plane_threshold", 0.1, true));
 	m_ui->proximity_threshold_sbox->setValue(m_config_file.read_double("plane_segmentation", "proximity_threshold", 0.4, true));
+	m_params.seg.temporal_tracking = m_config_file.read_bool("plane_segmentation", "temporal_tracking", false, true);
+	m_params.seg.min_tracking_confidence = m_config_file.read_double("plane_segmentation", "min_tracking_confidence", 0.8, true);
+	m_params.seg.tracking_dist_factor = m_config_file.read_double("plane_segmentation", "tracking_dist_factor", 3.0, true);
+	m_params.seg.guided_segmentation = m_config_file.read_bool("plane_segmentation", "guided_segmentation", false, true);
+	m_params.seg.guided_leftover_frac = m_config_file.read_double("plane_segmentation", "guided_leftover_frac", 0.2, true);
+	m_params.seg.guided_ransac_iters = m_config_file.read_int("plane_segmentation", "guided_ransac_iters", 50, true);
+	m_params.seg.guided_max_ransac_samples = m_config_file.read_int("plane_segmentation", "guided_max_ransac_samples", 2000, true);
+	m_params.seg.guided_max_failures = m_config_file.read_int("plane_segmentation", "guided_max_failures", 3, true);
+	m_params.match.prune_sensor_pairs = m_config_file.read_bool("plane_matching", "prune_sensor_pairs", false, true);
+	m_params.match.max_sensor_range = m_config_file.read_double("plane_matching", "max_sensor_range", 0, true);
+	m_params.match.use_normal_index = m_config_file.read_bool("plane_matching", "use_normal_index", false, true);
+	m_params.match.verify_normal_index = m_config_file.read_bool("plane_matching", "verify_normal_index", false, true);
+	m_params.match.use_descriptors = m_config_file.read_bool("plane_matching", "use_descriptors", false, true);
+	m_params.match.descriptor_tolerance = m_config_file.read_double("plane_matching", "descriptor_tolerance", 0.5, true);
+	m_params.match.hull_overlap_filter = m_config_file.read_bool("plane_matching", "hull_overlap_filter", false, true);
+	m_params.match.hull_overlap_margin = m_config_file.read_double("plane_matching", "hull_overlap_margin", 0.1, true);
+	m_params.match.ransac_filter = m_config_file.read_bool("plane_matching", "ransac_filter", false, true);
+	m_params.match.ransac_iters = m_config_file.read_int("plane_matching", "ransac_iters", 200, true);
+	m_params.match.ransac_angle_threshold = m_config_file.read_double("plane_matching", "ransac_angle_threshold", 2.0, true);
+	m_params.match.ransac_min_sample_angle = m_config_file.read_double("plane_matching", "ransac_min_sample_angle", 10.0, true);
+	m_params.match.track_clustering = m_config_file.read_bool("plane_matching", "track_clustering", false, true);
+	m_params.match.track_angle_threshold = m_config_file.read_double("plane_matching", "track_angle_threshold", 2.0, true);
+	m_params.match.track_dist_threshold = m_config_file.read_double("plane_matching", "track_dist_threshold", 0.05, true);
+	m_params.match.split_viewpoints = m_config_file.read_bool("plane_matching", "split_viewpoints", true, true);
+	m_params.match.viewpoint_angle_threshold = m_config_file.read_double("plane_matching", "viewpoint_angle_threshold", 10.0, true);
+	m_params.match.incremental_matching = m_config_file.read_bool("plane_matching", "incremental_matching", false, true);
+	m_params.match.threshold_sweep = m_config_file.read_bool("plane_matching", "threshold_sweep", false, true);
+	m_config_file.read_vector("plane_matching", "sweep_angle_thresholds", std::vector<double>{2, 5, 10}, m_params.match.sweep_angle_thresholds, true);
+	m_config_file.read_vector("plane_matching", "sweep_dist_thresholds", std::vector<double>{0.05, 0.1, 0.2}, m_params.match.sweep_dist_thresholds, true);
 	m_ui->max_iters_sbox->setValue(m_config_file.read_int("solver", "max_iters", 10, true));
 	m_ui->min_update_sbox->setValue(m_config_file.read_double("solver", "min_update", 0.00001, true));
 	m_ui->converge_error_sbox->setValue(m_config_file.read_double("solver", "convergence_error", 0.00001, true));
+	m_params.solver.sufficient_statistics = m_config_file.read_bool("solver", "sufficient_statistics", false, true);
+	m_params.solver.closed_form_init = m_config_file.read_bool("solver", "closed_form_init", false, true);
+	m_params.solver.sparse_min_sensors = m_config_file.read_int("solver", "sparse_min_sensors", 8, true);
+	m_params.solver.parallel_accumulation = m_config_file.read_bool("solver", "parallel_accumulation", false, true);
+	m_params.solver.accumulation_chunk_size = m_config_file.read_int("solver", "accumulation_chunk_size", 4096, true);
+	m_params.solver.joint_distance_weight = m_config_file.read_double("solver", "joint_distance_weight", 1.0, true);
+	std::string precision_string = m_config_file.read_string("solver", "precision", "FLOAT", true);
+
+	if(precision_string == "MIXED")
+		m_params.solver.precision = SOLVER_MIXED;
+	else if(precision_string == "DOUBLE")
+		m_params.solver.precision = SOLVER_DOUBLE;
+	else
+		m_params.solver.precision = SOLVER_FLOAT;
 }
 
 void CCalibFromPlanesConfig::extractPlanes()
@@ -2,6 +2,9 @@
 
 #include <mrpt/obs/CObservation3DRangeScan.h>
 
+#include <thread>
+#include <atomic>
+
 using namespace mrpt::obs;
 
 CCalibFromLinesGui::CCalibFromLinesGui(CObservationTree *model, TCalibFromLinesParams *params) :
@@ -160,7 +163,6 @@ void CCalibFromLinesGui::matchLines()
 {
 	publishText("****Running line matching algorithm****");
 
-	std::vector<Eigen::Matrix4f> sensor_poses = sync_model->getSensorPoses();
 	std::vector<std::string> sensor_labels;
 
 	CObservationTreeItem *root_item, *tree_item, *item;
@@ -168,47 +170,64 @@ void CCalibFromLinesGui::matchLines()
 	root_item = sync_model->getRootItem();
 	sensor_labels = sync_model->getSensorLabels();
 
-	std::vector<std::vector<CLine>> lines;
+	std::vector<std::vector<const std::vector<CLine>*>> lines;
 	std::vector<int> used_sets;
 
 	//for(int i = 0; i < root_item->childCount(); i++)
 	for(int i = 0; i < 15; i += params->downsample_factor)
 	{
 		tree_item = root_item->child(i);
-		lines.resize(sensor_labels.size());
-
-		publishText("**Finding matches between lines in set #" + std::to_string(i) + "**");
+		std::vector<const std::vector<CLine>*> set_lines(sensor_labels.size(), nullptr);
 
 		for(int j = 0; j < tree_item->childCount(); j++)
 		{
 			item = tree_item->child(j);
 			sensor_id = utils::findItemIndexIn(sensor_labels, item->getObservation()->sensorLabel);
 			sync_obs_id = sync_model->findSyncIndexFromSet(i, item->getObservation()->sensorLabel);
-			lines[sensor_id] = mvv_lines[sensor_id][sync_obs_id];
+			set_lines[sensor_id] = &mvv_lines[sensor_id][sync_obs_id];
 		}
 
-		findPotentialMatches(lines, i);
-		lines.clear();
+		lines.push_back(set_lines);
+		used_sets.push_back(i);
+	}
 
-		//print statistics
-		int count = 0;
+	// The sets are matched in parallel, each into its own buffer, and the buffers are merged in set order afterwards
+	// so that the correspondences do not depend on the scheduling of the threads.
+	std::vector<std::map<int,std::map<int,std::vector<std::array<int,3>>>>> set_corresp(used_sets.size());
+	std::atomic<size_t> next_set(0);
+	auto matchSets = [&]()
+	{
+		for(size_t k = next_set++; k < used_sets.size(); k = next_set++)
+			findPotentialMatches(lines[k], used_sets[k], set_corresp[k]);
+	};
+
+	size_t thread_count = std::min<size_t>(std::max(1u, std::thread::hardware_concurrency()), used_sets.size());
+	std::vector<std::thread> threads;
+	for(size_t t = 0; t < thread_count; t++)
+		threads.emplace_back(matchSets);
+	for(std::thread &thread : threads)
+		thread.join();
+
+	for(size_t k = 0; k < used_sets.size(); k++)
+	{
+		publishText("**Matches between lines in set #" + std::to_string(used_sets[k]) + "**");
 
-		for(std::map<int,std::map<int,std::vector<std::array<int,3>>>>::iterator iter1 = mmv_line_corresp.begin(); iter1 != mmv_line_corresp.end(); iter1++)
+		for(auto iter1 = set_corresp[k].begin(); iter1 != set_corresp[k].end(); iter1++)
+			for(auto iter2 = iter1->second.begin(); iter2 != iter1->second.end(); iter2++)
+				mmv_line_corresp[iter1->first][iter2->first].insert(mmv_line_corresp[iter1->first][iter2->first].end(), iter2->second.begin(), iter2->second.end());
+
+		//print statistics, counted from the set's own buffer
+		for(auto iter1 = mmv_line_corresp.begin(); iter1 != mmv_line_corresp.end(); iter1++)
 		{
-			for(std::map<int,std::vector<std::array<int,3>>>::iterator iter2 = iter1->second.begin(); iter2 != iter1->second.end(); iter2++)
+			for(auto iter2 = iter1->second.begin(); iter2 != iter1->second.end(); iter2++)
 			{
-				for(int k = 0; k < iter2->second.size(); k++)
-				{
-					if(iter2->second[k][0] == i)
-						count++;
-				}
+				size_t count = 0;
+				if(set_corresp[k].count(iter1->first) && set_corresp[k][iter1->first].count(iter2->first))
+					count = set_corresp[k][iter1->first][iter2->first].size();
 
 				publishText(std::to_string(count) + " matches found between " + sensor_labels[iter1->first] + " and " + sensor_labels[iter2->first]);
-				count = 0;
 			}
 		}
-
-		used_sets.push_back(i);
 	}
 
 	std::string s = "Used sets:\n";
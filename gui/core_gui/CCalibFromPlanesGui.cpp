@@ -14,6 +14,7 @@
 #include <pcl/common/time.h>
 
 #include <thread>
+#include <atomic>
 #include <functional>
 
 using namespace mrpt::obs;
@@ -60,30 +61,16 @@ void CCalibFromPlanesGui::publishCorrespPlanes(const int &obs_set_id)
 {
 	std::map<int,std::map<int,std::vector<std::array<CPlaneCHull,2>>>> corresp_planes;
 
-	for(std::map<int,std::map<int,std::vector<std::array<int,3>>>>::iterator it_sensor_i = mmv_plane_corresp.begin();
-	    it_sensor_i != mmv_plane_corresp.end(); it_sensor_i++)
-	{
-		int sensor_i = it_sensor_i->first;
-		for(std::map<int,std::vector<std::array<int,3>>>::iterator it_sensor_j = it_sensor_i->second.begin();
-		    it_sensor_j != it_sensor_i->second.end(); it_sensor_j++)
-		{
-			int sensor_j = it_sensor_j->first;
-			std::vector<std::array<int,3>> &correspondences = it_sensor_j->second;
-			for(int i = 0; i < correspondences.size(); i++)
+	auto set_ranges = m_plane_corresp.set_ranges.find(obs_set_id);
+	if(set_ranges != m_plane_corresp.set_ranges.end())
+		for(const std::array<size_t,2> &range : set_ranges->second)
+			for(size_t k = range[0]; k < range[1]; k++)
 			{
-				int set_id = correspondences[i][0];
-				if(set_id == obs_set_id)
-				{
-					int sync_obs1_id = sync_model->findSyncIndexFromSet(set_id, sync_model->getSensorLabels()[sensor_i]);
-					int sync_obs2_id = sync_model->findSyncIndexFromSet(set_id, sync_model->getSensorLabels()[sensor_j]);
-
-					std::array<CPlaneCHull,2> planes_pair{mvv_planes[sensor_i][sync_obs1_id][correspondences[i][1]],
-						                                 mvv_planes[sensor_j][sync_obs2_id][correspondences[i][2]]};
-					corresp_planes[sensor_i][sensor_j].push_back(planes_pair);
-				}
+				const TPlaneCorresp &row = m_plane_corresp.rows[k];
+				std::array<CPlaneCHull,2> planes_pair{mvv_planes[row.sensor_i][row.obs_i][row.plane_i],
+					                                 mvv_planes[row.sensor_j][row.obs_j][row.plane_j]};
+				corresp_planes[row.sensor_i][row.sensor_j].push_back(planes_pair);
 			}
-		}
-	}
 
 	for(CCorrespPlanesObserver *observer : m_corresp_planes_observers)
 	{
@@ -127,10 +114,15 @@ void CCalibFromPlanesGui::extractPlanes()
 	selected_sensor_labels = sync_model->getSensorLabels();
 	std::vector<int> used_sets;
 
+	// The intrinsics and range of each sensor, for predicting which sensor pairs overlap
+	std::vector<mrpt::img::TCamera> sensor_cameras(selected_sensor_labels.size());
+	std::vector<Scalar> sensor_max_ranges(selected_sensor_labels.size(), params->match.max_sensor_range);
+
 	for(size_t i = 0; i < selected_sensor_labels.size(); i++)
 	{
 		publishText("**Extracting planes from " + selected_sensor_labels[i] + " observations**");
 		mvv_planes[i].resize((sync_model->getSyncIndices()[i]).size());
+		int prev_sync_obs_id = -1;
 
 		for(size_t j = 0; j < 15; j += params->downsample_factor)
 		{
@@ -154,15 +146,45 @@ void CCalibFromPlanesGui::extractPlanes()
 
 					plane_segment_start = pcl::getTime();
 					segmented_planes.clear();
-					segmentPlanes(cloud, segmented_planes);
+
+					// Track the planes of the previous observation of this sensor, if possible
+					bool tracked = false;
+					if(params->seg.temporal_tracking && prev_sync_obs_id != -1 && !mvv_planes[i][prev_sync_obs_id].empty())
+						tracked = (trackPlanes(cloud, mvv_planes[i][prev_sync_obs_id], segmented_planes) >= params->seg.min_tracking_confidence);
+
+					if(!tracked)
+					{
+						segmented_planes.clear();
+
+						// Segment guided by the reference sensor's planes in the same set (the reference sensor is processed first),
+						// unless the reference sensor has no synchronized observation in the set
+						int ref_sync_obs_id = -1;
+						if(params->seg.guided_segmentation && i > 0)
+							ref_sync_obs_id = sync_model->findSyncIndexFromSet(j, selected_sensor_labels[0]);
+
+						if(ref_sync_obs_id >= 0 && ref_sync_obs_id < int(mvv_planes[0].size()))
+							segmentPlanesGuided(cloud, i, obs_item->cameraParams, mvv_planes[0][ref_sync_obs_id], segmented_planes);
+						else
+							segmentPlanes(cloud, segmented_planes);
+					}
+
 					plane_segment_end = pcl::getTime();
 
 					n_planes = segmented_planes.size();
-					publishText(std::to_string(n_planes) + " plane(s) extracted from observation #" + std::to_string(tree_item->child(k)->getPriorIndex())
+					publishText(std::to_string(n_planes) + " plane(s) " + (tracked ? "tracked into" : "extracted from") + " observation #" + std::to_string(tree_item->child(k)->getPriorIndex())
 					            + "\nTime elapsed: " +  std::to_string(plane_segment_end - plane_segment_start));
 
 					sync_obs_id = sync_model->findSyncIndexFromSet(j, obs_item->sensorLabel);
 					mvv_planes[i][sync_obs_id] = segmented_planes;
+
+					if(prev_sync_obs_id == -1)
+					{
+						sensor_cameras[i] = obs_item->cameraParams;
+						if(params->match.max_sensor_range <= 0)
+							sensor_max_ranges[i] = obs_item->maxRange;
+					}
+
+					prev_sync_obs_id = sync_obs_id;
 					prev_ts = obs_item->timestamp;
 				}
 			}
@@ -180,6 +202,12 @@ void CCalibFromPlanesGui::extractPlanes()
 
 	publishText(s);
 
+	computeSensorOverlap(sensor_cameras, sensor_max_ranges);
+	for(size_t i = 0; i < selected_sensor_labels.size(); i++)
+		for(size_t j = i + 1; j < selected_sensor_labels.size(); j++)
+			if(!sensorsOverlap(i, j))
+				publishText(selected_sensor_labels[i] + " and " + selected_sensor_labels[j] + " are not predicted to share any view");
+
 	params->calib_status = CalibFromPlanesStatus::PLANES_EXTRACTED;
 }
 
@@ -187,7 +215,6 @@ void CCalibFromPlanesGui::matchPlanes()
 {
 	publishText("****Running plane matching algorithm****");
 
-	std::vector<Eigen::Matrix4f> sensor_poses = sync_model->getSensorPoses();
 	std::vector<std::string> sensor_labels;
 
 	CObservationTreeItem *root_item, *tree_item, *item;
@@ -195,75 +222,175 @@ void CCalibFromPlanesGui::matchPlanes()
 	root_item = sync_model->getRootItem();
 	sensor_labels = sync_model->getSensorLabels();
 
-	std::vector<std::vector<CPlaneCHull>> planes;
+	std::vector<std::vector<const std::vector<CPlaneCHull>*>> planes;
 	std::vector<int> used_sets;
 
 	//for(int i = 0; i < root_item->childCount(); i++)
-	for(int i = 0; i < 15; i+= params->downsample_factor)
+	for(int i = 0; i < 15; i += params->downsample_factor)
 	{
 		tree_item = root_item->child(i);
-		planes.resize(sensor_labels.size());
-
-		publishText("**Finding matches between planes in set #" + std::to_string(i) + "**");
+		std::vector<const std::vector<CPlaneCHull>*> set_planes(sensor_labels.size(), nullptr);
 
 		for(int j = 0; j < tree_item->childCount(); j++)
 		{
 			item = tree_item->child(j);
 			sensor_id = utils::findItemIndexIn(sensor_labels, item->getObservation()->sensorLabel);
 			sync_obs_id = sync_model->findSyncIndexFromSet(i, item->getObservation()->sensorLabel);
-			planes[sensor_id] = mvv_planes[sensor_id][sync_obs_id];
+			set_planes[sensor_id] = &mvv_planes[sensor_id][sync_obs_id];
+
+			// The hulls are cached lazily, so they are calculated here rather than by the matching threads
+			if(params->match.hull_overlap_filter)
+				for(const CPlaneCHull &plane : mvv_planes[sensor_id][sync_obs_id])
+					plane.calcConvexHull();
 		}
 
-		findPotentialMatches(planes, i);
-		planes.clear();
+		planes.push_back(set_planes);
+		used_sets.push_back(i);
+	}
+
+	// The sets are matched in parallel, each into its own buffer, and the buffers are merged in set order afterwards
+	// so that the correspondences do not depend on the scheduling of the threads.
+	std::vector<std::map<int,std::map<int,std::vector<std::array<int,3>>>>> set_corresp(used_sets.size());
+	std::vector<std::map<std::pair<int,int>,TSetPairMatches>> set_pair_matches(used_sets.size());
+	std::vector<size_t> set_mismatches(used_sets.size(), 0);
+	std::atomic<size_t> next_set(0);
+	auto matchSets = [&]()
+	{
+		for(size_t k = next_set++; k < used_sets.size(); k = next_set++)
+			set_mismatches[k] = findPotentialMatches(planes[k], used_sets[k], set_corresp[k], params->match.incremental_matching ? &set_pair_matches[k] : nullptr);
+	};
+
+	size_t thread_count = std::min<size_t>(std::max(1u, std::thread::hardware_concurrency()), used_sets.size());
+	std::vector<std::thread> threads;
+	for(size_t t = 0; t < thread_count; t++)
+		threads.emplace_back(matchSets);
+	for(std::thread &thread : threads)
+		thread.join();
+
+	m_pair_matches.clear();
+	mv_matched_sets = used_sets;
+	for(size_t k = 0; k < used_sets.size(); k++)
+	{
+		for(auto iter = set_pair_matches[k].begin(); iter != set_pair_matches[k].end(); iter++)
+			m_pair_matches[iter->first][used_sets[k]] = iter->second;
+
+		publishText("**Matches between planes in set #" + std::to_string(used_sets[k]) + "**");
+		if(set_mismatches[k] > 0)
+			publishText("WARNING: the matches found through the normal index differ from the brute force ones in set #" + std::to_string(used_sets[k]));
+
+		for(auto iter1 = set_corresp[k].begin(); iter1 != set_corresp[k].end(); iter1++)
+			for(auto iter2 = iter1->second.begin(); iter2 != iter1->second.end(); iter2++)
+				mmv_plane_corresp[iter1->first][iter2->first].insert(mmv_plane_corresp[iter1->first][iter2->first].end(), iter2->second.begin(), iter2->second.end());
 
-		//print statistics
-		int count = 0;
-		for(std::map<int,std::map<int,std::vector<std::array<int,3>>>>::iterator iter1 = mmv_plane_corresp.begin(); iter1 != mmv_plane_corresp.end(); iter1++)
+		//print statistics, counted from the set's own buffer
+		for(auto iter1 = mmv_plane_corresp.begin(); iter1 != mmv_plane_corresp.end(); iter1++)
 		{
-			for(std::map<int,std::vector<std::array<int,3>>>::iterator iter2 = iter1->second.begin(); iter2 != iter1->second.end(); iter2++)
+			for(auto iter2 = iter1->second.begin(); iter2 != iter1->second.end(); iter2++)
 			{
-				for(int k = 0; k < iter2->second.size(); k++)
-				{
-					if(iter2->second[k][0] == i)
-						count++;
-				}
+				size_t count = 0;
+				if(set_corresp[k].count(iter1->first) && set_corresp[k][iter1->first].count(iter2->first))
+					count = set_corresp[k][iter1->first][iter2->first].size();
 
 				publishText(std::to_string(count) + " matches found between " + sensor_labels[iter1->first] + " and " + sensor_labels[iter2->first]);
-				count = 0;
 			}
 		}
-
-		used_sets.push_back(i);
 	}
 
+	updateCorrespTable();
+
 	std::string s = "Used sets:\n";
 	for(auto iter = used_sets.begin(); iter != used_sets.end(); iter++)
 		s = s + std::to_string((*iter)) + " ";
 
 	publishText(s);
 
+	if(params->match.threshold_sweep)
+	{
+		publishText("**Sweeping the matching thresholds**");
+
+		std::vector<Scalar> angle_thresholds(params->match.sweep_angle_thresholds.begin(), params->match.sweep_angle_thresholds.end());
+		std::vector<Scalar> dist_thresholds(params->match.sweep_dist_thresholds.begin(), params->match.sweep_dist_thresholds.end());
+		std::vector<TThresholdSweepPoint> sweep = sweepThresholds(planes, used_sets, angle_thresholds, dist_thresholds);
+
+		for(const TThresholdSweepPoint &point : sweep)
+		{
+			std::stringstream stream;
+			stream << "angle " << point.angle_threshold << " deg, distance " << point.dist_threshold << " m: "
+			       << point.num_corresp << " matches over " << point.num_pairs << " sensor pairs, final error " << point.result.final_error
+			       << ", conditioning " << point.result.conditioning << " (" << point.result.msg << ")";
+			publishText(stream.str());
+		}
+	}
+
 	params->calib_status = CalibFromPlanesStatus::PLANES_MATCHED;
 }
 
+void CCalibFromPlanesGui::rematchPlanes(const int &sensor_id)
+{
+	if(!params->match.incremental_matching)
+		return;
+
+	std::vector<std::string> sensor_labels = sync_model->getSensorLabels();
+	publishText("****Re-matching the planes of " + sensor_labels[sensor_id] + " under the edited calibration****");
+
+	size_t rematched = rematchSensorPairs(sensor_id);
+	publishText(std::to_string(rematched) + " sensor pair matchings re-run or dropped across the sets");
+
+	for(auto iter = m_pair_matches.begin(); iter != m_pair_matches.end(); iter++)
+		if(iter->first.first == sensor_id || iter->first.second == sensor_id)
+			publishText(std::to_string(mmv_plane_corresp[iter->first.first][iter->first.second].size()) + " matches found between "
+			            + sensor_labels[iter->first.first] + " and " + sensor_labels[iter->first.second]);
+
+	if(rematched > 0)
+		updateCorrespTable();
+}
+
+void CCalibFromPlanesGui::updateCorrespTable()
+{
+	std::vector<std::string> sensor_labels = sync_model->getSensorLabels();
+	buildCorrespTable();
+
+	if(params->match.ransac_filter)
+	{
+		publishText("**Filtering the matches by the consensus rotation of each sensor pair**");
+
+		std::map<std::pair<int,int>,std::array<size_t,2>> pair_ranges = m_plane_corresp.pair_ranges;
+		filterCorrespondences();
+
+		for(auto iter = pair_ranges.begin(); iter != pair_ranges.end(); iter++)
+		{
+			size_t count = m_plane_corresp.pair_ranges.count(iter->first) ? m_plane_corresp.pair_ranges[iter->first][1] - m_plane_corresp.pair_ranges[iter->first][0] : 0;
+			publishText(std::to_string(count) + " of " + std::to_string(iter->second[1] - iter->second[0]) + " matches kept between "
+			        + sensor_labels[iter->first.first] + " and " + sensor_labels[iter->first.second]);
+		}
+	}
+
+	if(params->match.track_clustering)
+	{
+		size_t corresp_count = m_plane_corresp.rows.size();
+		clusterCorrespondences();
+		publishText(std::to_string(corresp_count) + " matches collapsed into " + std::to_string(m_plane_corresp.rows.size()) + " plane track matches");
+	}
+}
+
 void CCalibFromPlanesGui::calibrate()
 {
 	publishText("****Running the calibration solver****");
-	computeRotation();
+	computeCalibration();
 
-	publishText("**Results of the rotation solver**");
+	publishText("**Results of the calibration solver**");
 
 	std::string stats;
 	std::stringstream stream;
 
 	for(int sensor_id = 0; sensor_id < sync_model->getNumberOfSensors(); sensor_id++)
-		stream << result.estimate[sensor_id].block(0,0,3,3) << "\n";
+		stream << result.estimate[sensor_id] << "\n";
 
 	stats = "Status: " + result.msg;
 	stats += "\nInitial error: " + std::to_string(result.init_error);
 	stats += "\nNumber of iterations: " + std::to_string(result.num_iters);
 	stats += "\nFinal error: " + std::to_string(result.final_error);
-	stats += "\n\nEstimated rotation: \n";
+	stats += "\n\nEstimated calibration: \n";
 	stats += stream.str();
 
 	publishText(stats);
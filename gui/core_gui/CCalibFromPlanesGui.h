@@ -37,6 +37,11 @@ public:
 	/** Runs plane matching. */
 	void matchPlanes();
 
+	/** Re-matches the planes of the sensor pairs of an edited sensor, when incremental_matching is set.
+	 * \param sensor_id the id of the sensor whose initial calibration was edited.
+	 */
+	void rematchPlanes(const int &sensor_id);
+
 	/** Runs the calibration solver. */
 	void calibrate();
 
@@ -59,6 +64,7 @@ public:
 	void publishPlanes(const int &sensor_id, const int &sync_obs_id);
 
 	/** Notifies observers with the planes that were matched between each pair of sensors in a sync set, if any.
+	 * After clusterCorrespondences(), a collapsed match is only shown under the set of its first correspondence.
 	 * \param obs_set_id the id of the synchronized observation set.
 	 */
 	void publishCorrespPlanes(const int &obs_set_id);
@@ -68,6 +74,9 @@ public:
 
 private:
 
+	/** Builds the correspondence table from the matches, and filters and clusters it as configured. */
+	void updateCorrespTable();
+
 	/** List of text observers to be notified about the progress. */
 	std::vector<CTextObserver*> m_text_observers;
 
@@ -266,13 +266,14 @@ void CViewerContainer::onReceivingPlanes(const int &sensor_id, const std::vector
 			        planes[i].v3center[2] + (0.5f * planes[i].v3normal[2]));
 
 			m_viewers[viewer_id]->addArrow(pt2, pt1, 0.5 * utils::colors::red[i%10] / 255, utils::colors::grn[i%10] / 255, utils::colors::blu[i%10] / 255, false, normal_id);
-			m_viewers[viewer_id]->addPolygon<pcl::PointXYZRGBA>(planes[i].ConvexHullPtr, utils::colors::red[i%10], utils::colors::grn[i%10], utils::colors::blu[i%10], polygon_id);
+			m_viewers[viewer_id]->addPolygon<pcl::PointXYZRGBA>(planes[i].getConvexHull(), utils::colors::red[i%10], utils::colors::grn[i%10], utils::colors::blu[i%10], polygon_id);
 
-			size_t indices_size = planes[i].v_hull_indices.size();
+			const std::vector<size_t> &hull_indices = planes[i].getHullIndices();
+			size_t indices_size = hull_indices.size();
 			for(size_t j = 0; j < indices_size; j++)
 			{
-				cv::line(img, cv::Point(planes[i].v_hull_indices[j]%width, planes[i].v_hull_indices[j]/width),
-				         cv::Point(planes[i].v_hull_indices[(j+1)%indices_size]%width, planes[i].v_hull_indices[(j+1)%indices_size]/width),
+				cv::line(img, cv::Point(hull_indices[j]%width, hull_indices[j]/width),
+				         cv::Point(hull_indices[(j+1)%indices_size]%width, hull_indices[(j+1)%indices_size]/width),
 				        cv::Scalar(utils::colors::blu[i%10], utils::colors::grn[i%10], utils::colors::red[i%10]), 3);
 			}
 		}
@@ -355,7 +356,7 @@ void CViewerContainer::onReceivingCorrespPlanes(std::map<int,std::map<int,std::v
 			        planes_pair[j].v3center[2] + (0.5f * planes_pair[j].v3normal[2]));
 
 			rt.matrix() = sensor_poses[m_vsensor_ids[j]];
-			pcl::transformPointCloud(*planes_pair[j].ConvexHullPtr, *transformed_polygon, rt);
+			pcl::transformPointCloud(*planes_pair[j].getConvexHull(), *transformed_polygon, rt);
 			utils::transformPoint(rt, pt1);
 			utils::transformPoint(rt, pt2);
 